@@ -1,15 +1,19 @@
+#define _GNU_SOURCE
+
 #include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <arpa/inet.h>
-#include <regex.h>
+#include <ctype.h>
+#include <strings.h>
 
 #include "asgn2_helper_funcs.h"
 
@@ -17,22 +21,17 @@
 #define MAX_BUF      4096
 #define MAX_RESPONSE 200 // since the longest resonse without message could have max 185 bytes, using 200 just to be careful
 #define MAX_PHRASE 22 // since the longest status phrase has 22 bytes
-////// Request Line Regex
-#define METHOD       "([a-zA-Z]{1,8})" // character range [a-zA-Z] at most 8 characters
-#define URI          "([a-zA-Z0-9.-]{1,63})" // characte range [a-zA-Z0-9.-] and at least 2 characters and at most 64 characters
-#define VERSIONX     "([0-9]{1})" // HTTP/VERSIONX.VERSIONY
-#define VERSIONY     "([0-9]{1})"
-#define REQUEST_LINE "^" METHOD " " "/" URI " HTTP/" VERSIONX "." VERSIONY
-
-////// Header-field Regex
-#define KEY          "([a-zA-Z0-9.-]{1,128})" // character range words, numbers, . and -
-#define VALUE        "([ -~]{1,128})" // any ascii character
-#define COLON        "([:]{1})"
-#define HEADER_FIELD "^" KEY COLON VALUE
+#define MAX_CHUNK  (1 << 20) // the most bytes moved by one sendfile/splice call
+////// Request grammar
+// Request line: METHOD " /" URI " HTTP/" X "." Y "\r\n"
+// Header field: KEY ":" VALUE "\r\n", and an empty line ends the header
+#define MAX_METHOD 8 // [a-zA-Z]
+#define MAX_URI    63 // [a-zA-Z0-9.-]
+#define MAX_KEY    128 // [a-zA-Z0-9.-]
+#define MAX_VALUE  128 // any printable ascii character, including space
 
 static int Status_Code = 999;
-static char *found = NULL;
-static int Length = 999;
+static int Pipe[2] = { -1, -1 }; // kept open for splicing PUT bodies into files
 
 // global value for status code and phrases
 enum StatusCode {
@@ -61,11 +60,33 @@ static const char *const StatusPhrase[] = { [Ok] = "OK",
 // @param file_fd: the file we're reading from
 // @return: nothing at the moment
 // @usage: get retrieves data in filename and output it to socket_fd
+// with sendfile (the bytes never leave the kernel), falling back to a
+// userspace buffer if the file doesn't support sendfile
 // closes filename when exit, but not socket_fd
 void get(int file_fd, int socket_fd) {
     char buff[MAX_BUF] = { 0 };
     int bytes_read = 0;
     int n;
+    ssize_t sent;
+    bool any = false;
+
+    while ((sent = sendfile(socket_fd, file_fd, NULL, MAX_CHUNK)) != 0) {
+        if (sent < 0 && errno == EINTR) {
+            errno = 0;
+        } else if (sent < 0 && !any && (errno == EINVAL || errno == ENOSYS)) {
+            errno = 0;
+            break;
+        } else if (sent < 0) {
+            fprintf(stderr, "%s\n", strerror(errno));
+            fprintf(stderr, "can't write to socket\n");
+            exit(1);
+        } else {
+            any = true;
+        }
+    }
+    if (sent == 0) {
+        return;
+    }
 
     // since read_until terminates when buf contains NULL or reaches EOF
     // or MAX_BUF bytes is read
@@ -89,21 +110,77 @@ void get(int file_fd, int socket_fd) {
 
 // @param filename: the name of the file we're reading from
 // @param socket_fd: the socket we're reading from
-// @return: nothing at the moment
+// @return: false if the client hung up before all of the bytes arrived
 // @usage: put what we read from socket_fd into filename
+// with splice through a pipe (the bytes never leave the kernel),
+// falling back to a userspace buffer if the file doesn't support splice
 // closes filename when exit, but not socket_fd
-void put(int file_fd, int socket_fd, int bytes) {
+bool put(int file_fd, int socket_fd, int bytes) {
     char buff[MAX_BUF] = { 0 };
     int bytes_wrote;
     int n;
-    do {
+    int moved = 0;
+
+    if (Pipe[0] < 0 && pipe(Pipe) < 0) {
+        Pipe[0] = Pipe[1] = -1;
+    }
+    while (Pipe[0] >= 0 && moved < bytes) {
+        int want = bytes - moved < MAX_CHUNK ? bytes - moved : MAX_CHUNK;
+        ssize_t in = splice(socket_fd, NULL, Pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == 0) {
+            return false;
+        } else if (in < 0 && errno == EINTR) {
+            errno = 0;
+            continue;
+        } else if (in < 0 && moved == 0 && errno == EINVAL) {
+            errno = 0;
+            break;
+        } else if (in < 0) {
+            fprintf(stderr, "%s\n", strerror(errno));
+            fprintf(stderr, "can't read from socket\n");
+            exit(1);
+        }
+        while (in > 0) {
+            ssize_t out = splice(Pipe[0], NULL, file_fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) {
+                errno = 0;
+                continue;
+            } else if (out < 0 && moved == 0 && errno == EINVAL) {
+                // the file doesn't support splice: copy what is already
+                // in the pipe by hand, then fall back for the rest
+                errno = 0;
+                while (in > 0) {
+                    n = read(Pipe[0], buff, in < MAX_BUF ? in : MAX_BUF);
+                    if (n <= 0 || write_all(file_fd, buff, n) < 0) {
+                        fprintf(stderr, "can't write to file\n");
+                        exit(1);
+                    }
+                    in -= n;
+                    moved += n;
+                }
+                close(Pipe[0]);
+                close(Pipe[1]);
+                Pipe[0] = Pipe[1] = -1;
+                break;
+            } else if (out <= 0) {
+                fprintf(stderr, "%s\n", strerror(errno));
+                fprintf(stderr, "can't write to file\n");
+                exit(1);
+            }
+            in -= out;
+            moved += out;
+        }
+    }
+    while (moved < bytes) {
         // clear buff
         bzero(buff, MAX_BUF);
-        n = read_until(socket_fd, buff, bytes, NULL);
+        n = read_until(socket_fd, buff, bytes - moved < MAX_BUF ? bytes - moved : MAX_BUF, NULL);
         if (n < 0 || errno != 0) {
             fprintf(stderr, "%s\n", strerror(errno));
             fprintf(stderr, "can't read from socket\n");
             exit(1);
+        } else if (n == 0) {
+            return false;
         }
 
         bytes_wrote = write_all(file_fd, buff, n);
@@ -112,8 +189,9 @@ void put(int file_fd, int socket_fd, int bytes) {
             fprintf(stderr, "can't write to socket\n");
             exit(1);
         }
-
-    } while (n > 0);
+        moved += n;
+    }
+    return true;
 }
 
 // @param socket_fd: the socket file descripter we're writing to
@@ -139,65 +217,171 @@ void sending_message(int socket_fd, int vx, int vy, int code, int length) {
     write_all(socket_fd, buffer, n);
 }
 
-// @param buf: buffer that might contain the double \r\n
-// @usage: check if the buffer contains \r\n\r\n
-// @return: true if buffer contain \r\n\r\n else false
-bool check_header(char *buf) {
-    char *ret = strstr(buf, "\r\n\r\n");
-    if (ret == NULL) {
-        return false;
-    } else {
-        return true;
-    }
+// @param socket_fd: the socket file descripter we're writing to
+// @param code: the status code
+// @usage: sends a response whose message body is the status phrase
+// returns: nothing
+void sending_status(int socket_fd, int code) {
+    char buffer[MAX_RESPONSE] = { 0 };
+    int n = sprintf(buffer, "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n\r\n%s\n", code,
+        StatusPhrase[code], strlen(StatusPhrase[code]) + 1, StatusPhrase[code]);
+    write_all(socket_fd, buffer, n);
 }
 
-// @param buf: the buffer to look for pattern from regex r
-// @param r: the regex we want to check on
-// @usage: used to check if buf contains invalid format
-// @return: returns NULL when everything matches with regex r
-// @return: returns NULL and status_code set to 400 when something doesn't match
-// @return: returns a string when everything matches except the last token
-// because the last token might be incomplete due to read_bytes restrictions
-char *parsing_header(char *buf, regex_t r) {
-    int rn;
-    char *Ntoken = NULL;
-    char *Ctoken = NULL;
-
-    Ntoken = strtok(buf, "\r\n");
-    while (Ntoken != NULL) {
-        // update current token
-        Ctoken = Ntoken;
-        // regex current token
-        rn = regexec(&r, Ctoken, 0, NULL, 0);
-        // get the next token
-        Ntoken = strtok(NULL, "\r\n");
-        // when regex doens't match and we're not at the end of the buf
-        if (rn == 1 && Ntoken != NULL) {
-            Status_Code = 400;
-            Ntoken = NULL;
-            return Ntoken;
-            // when regex doesn't match and we are at the end of the buf
-            // returning Ctoken because the rest of the header field might
-            // be cut off due to size read from read_until
-        } else if (rn == 1) {
-            return Ntoken;
-            // when the regex matches
+// states of the request parser; each names what the next byte may be
+enum ParseState {
+    P_METHOD, // a method character, or the space after the method
+    P_SLASH, // the "/" that starts the URI
+    P_URI, // a URI character, or the space after the URI
+    P_HTTP, // the next character of "HTTP/"
+    P_VERX, // the major version digit
+    P_DOT, // the "." between the version digits
+    P_VERY, // the minor version digit
+    P_LINE_CR, // the "\r" that ends the request line
+    P_LINE_LF, // the "\n" that ends the request line
+    P_FIELD, // the first character of a key, or the "\r" of the empty line
+    P_KEY, // a key character, or the ":" after the key
+    P_VALUE, // a value character, or the "\r" after the value
+    P_FIELD_LF, // the "\n" that ends a header field
+    P_END_LF, // the "\n" of the empty line that ends the header
+    P_DONE, // the header is complete
+    P_ERROR, // the request is malformed (400)
+};
+
+// everything we keep from a request; the parser never allocates
+struct Request {
+    enum ParseState state;
+    int pos; // characters of the current token seen so far
+    char method[MAX_METHOD + 1];
+    char uri[MAX_URI + 1];
+    int vx, vy; // HTTP/vx.vy
+    char key[MAX_KEY + 1];
+    bool is_length; // the current field is Content-Length
+    int digits; // digits of Content-Length seen so far
+    bool has_length;
+    int length; // the value of Content-Length
+};
+
+// @param r: the request to initialize
+// @usage: resets r to parse a new request from its first byte
+void request_init(struct Request *r) {
+    memset(r, 0, sizeof(*r));
+    r->state = P_METHOD;
+}
+
+static bool uri_char(char c) {
+    return isalnum((unsigned char) c) || c == '.' || c == '-';
+}
+
+// @param r: the request being parsed
+// @param c: the next byte of the request
+// @usage: advances the state machine of r by one byte
+static void parse_char(struct Request *r, char c) {
+    switch (r->state) {
+    case P_METHOD:
+        if (c == ' ' && r->pos > 0) {
+            r->state = P_SLASH;
+        } else if (isalpha((unsigned char) c) && r->pos < MAX_METHOD) {
+            r->method[r->pos++] = c;
         } else {
-            // look for content-Length
-            found = strstr(Ctoken, "Content-Length");
-            if (found) {
-                sscanf(found, "%*[^0123456789]%d", &Length);
-            } else {
-                found = strstr(Ctoken, "content-length");
-                if (found) {
-                    sscanf(found, "%*[^0123456789]%d", &Length);
+            r->state = P_ERROR;
+        }
+        break;
+    case P_SLASH:
+        r->pos = 0;
+        r->state = c == '/' ? P_URI : P_ERROR;
+        break;
+    case P_URI:
+        if (c == ' ' && r->pos > 0) {
+            r->pos = 0;
+            r->state = P_HTTP;
+        } else if (uri_char(c) && r->pos < MAX_URI) {
+            r->uri[r->pos++] = c;
+        } else {
+            r->state = P_ERROR;
+        }
+        break;
+    case P_HTTP:
+        if (c != "HTTP/"[r->pos]) {
+            r->state = P_ERROR;
+        } else if (++r->pos == 5) {
+            r->state = P_VERX;
+        }
+        break;
+    case P_VERX:
+        r->vx = c - '0';
+        r->state = isdigit((unsigned char) c) ? P_DOT : P_ERROR;
+        break;
+    case P_DOT: r->state = c == '.' ? P_VERY : P_ERROR; break;
+    case P_VERY:
+        r->vy = c - '0';
+        r->state = isdigit((unsigned char) c) ? P_LINE_CR : P_ERROR;
+        break;
+    case P_LINE_CR: r->state = c == '\r' ? P_LINE_LF : P_ERROR; break;
+    case P_LINE_LF:
+    case P_FIELD_LF: r->state = c == '\n' ? P_FIELD : P_ERROR; break;
+    case P_FIELD:
+        r->pos = 0;
+        if (c == '\r') {
+            r->state = P_END_LF;
+            break;
+        }
+        // c is the first character of the key
+        r->state = P_KEY;
+        // fall through
+    case P_KEY:
+        if (c == ':' && r->pos > 0) {
+            r->key[r->pos] = 0;
+            r->is_length = strcasecmp(r->key, "Content-Length") == 0;
+            if (r->is_length) {
+                r->has_length = true;
+                r->length = 0;
+                r->digits = 0;
+            }
+            r->pos = 0;
+            r->state = P_VALUE;
+        } else if (uri_char(c) && r->pos < MAX_KEY) {
+            r->key[r->pos++] = c;
+        } else {
+            r->state = P_ERROR;
+        }
+        break;
+    case P_VALUE:
+        if (c == '\r' && r->pos > 0) {
+            r->state = r->is_length && r->digits == 0 ? P_ERROR : P_FIELD_LF;
+        } else if (c < ' ' || c > '~' || r->pos == MAX_VALUE) {
+            r->state = P_ERROR;
+        } else {
+            r->pos++;
+            if (r->is_length && (c != ' ' || r->digits > 0)) {
+                // Content-Length: [spaces] digits
+                if (!isdigit((unsigned char) c) || r->length > (INT32_MAX - 9) / 10) {
+                    r->state = P_ERROR;
+                } else {
+                    r->length = r->length * 10 + (c - '0');
+                    r->digits++;
                 }
             }
         }
+        break;
+    case P_END_LF: r->state = c == '\n' ? P_DONE : P_ERROR; break;
+    case P_DONE:
+    case P_ERROR: break;
+    }
+}
+
+// @param r: the request being parsed
+// @param buf: the next len bytes of the request
+// @usage: feeds bytes to the parser until the header is complete or
+// malformed; can be called again with more bytes after a partial read
+// @return: the number of bytes consumed. Bytes after the header (the
+// start of the message body) are not consumed
+int parse_request(struct Request *r, const char *buf, int len) {
+    int i = 0;
+    while (i < len && r->state != P_DONE && r->state != P_ERROR) {
+        parse_char(r, buf[i++]);
     }
-    // when the whole buf matches with the regex requriemend
-    Ctoken = NULL;
-    return Ctoken;
+    return i;
 }
 
 int main(int argc, char **argv) {
@@ -209,8 +393,6 @@ int main(int argc, char **argv) {
     //int Status_Code;
     int file_fd;
 
-    bool header = false; // keep tracks if we have header
-
     // checking usage
     if (argc != 2) {
         fprintf(stderr, "usage: %s <port>\n", argv[0]);
@@ -237,97 +419,54 @@ int main(int argc, char **argv) {
         new_socket_fd = listener_accept(&socket_fd);
         bzero(buf, MAX_REQUEST);
 
-        // getting client input
-        int n;
-        n = read_until(new_socket_fd, buf, MAX_REQUEST, "\r\n\r\n");
-        if (n < 0 || errno != 0) {
-            Status_Code = 500;
-            sending_message(new_socket_fd, 1, 1, Status_Code, 22);
-            close(new_socket_fd);
-            continue;
+        // getting client input: read until the parser has seen the
+        // whole header, resuming where it stopped after every read
+        struct Request req;
+        request_init(&req);
+        int have = 0; // bytes in buf
+        int used = 0; // bytes of buf consumed by the parser
+        while (req.state != P_DONE && req.state != P_ERROR && have < MAX_REQUEST) {
+            int n = read(new_socket_fd, buf + have, MAX_REQUEST - have);
+            if (n < 0 && errno == EINTR) {
+                errno = 0;
+                continue;
+            } else if (n <= 0) {
+                break;
+            }
+            have += n;
+            used += parse_request(&req, buf + used, have - used);
         }
 
-        // checks if we found header
-        header = check_header(buf);
-
-        //////////////////////////////Parsing Request Line //////////////////////////
-        // parsing buf with no \r\n included
-        int len = strcspn(buf, "\r\n");
-        // saving the extra bytes just incase
-        char buf_rest[MAX_BUF] = { 0 };
-        strncpy(buf_rest, buf + len + 2, MAX_REQUEST - len);
-
-        buf[len] = 0;
-
-        // creating new regular expression for request_line
-        regex_t req;
-        int req_r;
-        regmatch_t req_line[5];
-
-        req_r = regcomp(&req, REQUEST_LINE, REG_EXTENDED);
-        if (req_r) {
+        if (req.state != P_DONE && req.state != P_ERROR && errno != 0) {
+            // the read failed (or timed out)
             Status_Code = 500;
             sending_message(new_socket_fd, 1, 1, Status_Code, 22);
             close(new_socket_fd);
             continue;
-        }
-
-        // check if parsed buffer matches the Method URI Version format
-        req_r = regexec(&req, buf, 5, req_line, 0);
-        // no matches found, should return status 400
-        if (req_r) {
-            //printf("No matches found\n");
-            regfree(&req);
+        } else if (req.state != P_DONE) {
+            // malformed, too long, or cut off by the client
             Status_Code = 400;
             sending_message(new_socket_fd, 1, 1, Status_Code, 12);
             close(new_socket_fd);
             continue;
         }
 
-        // retrieving method from request line
-        char method[8] = { 0 };
-        int method_start = req_line[1].rm_so;
-        int method_end = req_line[1].rm_eo;
-        int method_length = method_end - method_start;
-        strncpy(method, buf + method_start, method_length);
-        // retrieving uri from request line
-        char uri[63] = { 0 };
-        int uri_start = req_line[2].rm_so;
-        int uri_end = req_line[2].rm_eo;
-        int uri_length = uri_end - uri_start;
-        strncpy(uri, buf + uri_start, uri_length);
-        // retrieving version number x.y
-        int VerX, VerY;
-        int VerX_start = req_line[3].rm_so;
-        VerX = atoi(&buf[VerX_start]);
-        int VerY_start = req_line[4].rm_so;
-        VerY = atoi(&buf[VerY_start]);
-
-        if (!(VerX == 1 && VerY == 1)) {
-            if ((0 <= VerX) && (0 <= VerY) && (VerX <= 9) && (VerY <= 9)) {
-                Status_Code = 505;
-                sending_message(new_socket_fd, 1, 1, Status_Code, 22);
-                close(new_socket_fd);
-                continue;
-            } else {
-                Status_Code = 400;
-                sending_message(new_socket_fd, 1, 1, Status_Code, 12);
-                close(new_socket_fd);
-                close(file_fd);
-                continue;
-            }
+        if (!(req.vx == 1 && req.vy == 1)) {
+            Status_Code = 505;
+            sending_message(new_socket_fd, 1, 1, Status_Code, 22);
+            close(new_socket_fd);
+            continue;
         }
-        regfree(&req);
 
         /////////////////////////// Processing Request////////////////////////////
 
-        if (strcmp(method, "GET") == 0) {
+        if (strcmp(req.method, "GET") == 0) {
 
-            file_fd = open(uri, O_RDONLY);
+            file_fd = open(req.uri, O_RDONLY);
             // checks why can't we access the file
             if (file_fd < 0) {
                 // file doens't exist?
-                if (access(uri, F_OK)) {
+                if (access(req.uri, F_OK)) {
                     Status_Code = 404;
                     sending_message(new_socket_fd, 1, 1, Status_Code, 10);
                     close(new_socket_fd);
@@ -341,19 +480,6 @@ int main(int argc, char **argv) {
                 }
             }
 
-            while (!header) {
-                bzero(buf, MAX_REQUEST);
-                n = read_until(new_socket_fd, buf, MAX_REQUEST, "\r\n\r\n");
-                header = check_header(buf);
-                if (!header && n < MAX_REQUEST) {
-                    Status_Code = 400;
-                    sending_message(new_socket_fd, 1, 1, Status_Code, 12);
-                    close(file_fd);
-                    close(new_socket_fd);
-                    continue;
-                }
-            }
-
             Status_Code = 200;
             struct stat st;
             fstat(file_fd, &st);
@@ -361,130 +487,58 @@ int main(int argc, char **argv) {
             get(file_fd, new_socket_fd);
             close(file_fd);
             close(new_socket_fd);
-        } else if (strcmp(method, "PUT") == 0) {
+        } else if (strcmp(req.method, "PUT") == 0) {
+
+            if (!req.has_length) {
+                Status_Code = 400;
+                sending_message(new_socket_fd, 1, 1, Status_Code, 12);
+                close(new_socket_fd);
+                continue;
+            }
 
-            file_fd = open(uri, O_WRONLY | O_TRUNC);
+            bool existed = access(req.uri, F_OK) == 0;
+            file_fd = open(req.uri, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
 
             // checks if we can't access the file
             if (file_fd < 0) {
                 if (errno == EROFS) {
                     Status_Code = 403;
                     sending_message(new_socket_fd, 1, 1, Status_Code, 10);
-                    close(new_socket_fd);
-                    continue;
-                }
-                file_fd = open(uri, O_CREAT, S_IRWXU);
-                // can't create a new file
-                if (file_fd < 0) {
-
-                    //   fprintf(stderr, "Invalid Command\n");
+                } else {
                     Status_Code = 500;
                     sending_message(new_socket_fd, 1, 1, Status_Code, 22);
-                    close(new_socket_fd);
-                    continue;
                 }
-                Status_Code = 201;
-            } else {
-                Status_Code = 200;
+                close(new_socket_fd);
+                continue;
             }
+            Status_Code = existed ? 200 : 201;
 
-            //////////// Parsing for Header-Field //////////////////
-
-            regex_t head;
-            int head_r;
-            // compiling regex for header-field
-            head_r = regcomp(&head, HEADER_FIELD, REG_EXTENDED);
-            if (head_r) {
+            // the start of the body may have arrived with the header
+            int rest = have - used;
+            if (rest > req.length) {
+                rest = req.length;
+            }
+            if (rest > 0 && write_all(file_fd, buf + used, rest) < 0) {
+                fprintf(stderr, "%s\n", strerror(errno));
+                fprintf(stderr, "can't write to file\n");
                 Status_Code = 500;
                 sending_message(new_socket_fd, 1, 1, Status_Code, 22);
                 close(file_fd);
                 close(new_socket_fd);
                 continue;
             }
-
-            // see if header exist
-            header = check_header(buf_rest);
-            char buf_rest_rest[MAX_BUF] = { 0 };
-            char temp[MAX_BUF] = { 0 };
-            char *t = NULL; // temp
-            // loopinggg
-            while (!header) {
-                // parsing through buf_rest
-                // and store the result into buf_rest_rest
-                t = parsing_header(buf_rest, head);
-                // if the parsing actuall had somethint left
-                if (t) {
-                    strcpy(buf_rest_rest, t);
-                    bzero(temp, MAX_BUF);
-                    read_until(new_socket_fd, temp, MAX_BUF - strlen(buf_rest_rest), "\r\n\r\n");
-                    bzero(buf_rest, MAX_BUF);
-                    sprintf(buf_rest, "%.*s%.*s", (int) strlen(buf_rest_rest), buf_rest_rest,
-                        (int) strlen(temp), temp);
-                } else if (Status_Code == 400) {
-                    break;
-
-                } else {
-                    read_until(new_socket_fd, buf_rest, MAX_BUF, "\r\n\r\n");
+            if (req.length > rest && !put(file_fd, new_socket_fd, req.length - rest)) {
+                // a short body is not stored as the file
+                if (!existed) {
+                    unlink(req.uri);
                 }
-                header = check_header(buf_rest);
-                bzero(buf_rest_rest, MAX_BUF);
-            } // end of big while loop
-
-            // this means the status_code was 400 during last while loop
-            if (!header) {
-                sending_message(new_socket_fd, 1, 1, Status_Code, 12);
-                close(new_socket_fd);
-                close(file_fd);
-                continue;
-            }
-
-            // out of the loop means header is found
-            // and the rest of the input is stored in buf_rest
-
-            // seperate header-field in buf_rest
-            char header_buf[MAX_BUF] = { 0 };
-            t = strstr(buf_rest, "\r\n\r\n");
-            sprintf(header_buf, "%.*s", (int) (strlen(buf_rest) - strlen(t)), buf_rest);
-
-            // parse through header_buf to check with regex
-            t = parsing_header(header_buf, head);
-
-            if (Length == 999) {
                 Status_Code = 400;
                 sending_message(new_socket_fd, 1, 1, Status_Code, 12);
-                close(new_socket_fd);
                 close(file_fd);
-                continue;
-            }
-            if (Status_Code == 400) {
-                sending_message(new_socket_fd, 1, 1, Status_Code, 12);
                 close(new_socket_fd);
-                close(file_fd);
                 continue;
             }
-            // seperate remaining message form buf_rest
-            t = strtok(buf_rest, "\r\n\r\n");
-            t = strtok(NULL, "\r\n\r\n");
-            if (t) {
-
-                int bytes_wrote = write_all(file_fd, t, strlen(t));
-                if (bytes_wrote < 0 || errno != 0) {
-                    fprintf(stderr, "%s\n", strerror(errno));
-                    fprintf(stderr, "can't write to socket\n");
-                    Status_Code = 500;
-                    sending_message(new_socket_fd, 1, 1, Status_Code, 22);
-                    close(new_socket_fd);
-                    continue;
-                }
-
-                put(file_fd, new_socket_fd, Length - strlen(t));
-                sending_message(
-                    new_socket_fd, 1, 1, Status_Code, strlen(StatusPhrase[Status_Code]));
-            } else {
-                put(file_fd, new_socket_fd, Length);
-                sending_message(
-                    new_socket_fd, 1, 1, Status_Code, strlen(StatusPhrase[Status_Code]));
-            }
+            sending_status(new_socket_fd, Status_Code);
             close(file_fd);
             close(new_socket_fd);
 
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+// the highest NUMA node that "all" looks for
+#define MAX_NODES 64
+
+// Append the CPUs in a kernel-format list to cpus[*n..max), skipping
+// ones that are already there. Returns false if the list is malformed.
+static bool parse_list(const char *list, int *cpus, int *n, int max) {
+    const char *p = list;
+    while (*p != '\0' && *p != '\n') {
+        if (!isdigit((unsigned char) *p)) {
+            return false;
+        }
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (*end == '-') {
+            if (!isdigit((unsigned char) end[1])) {
+                return false;
+            }
+            last = strtol(end + 1, &end, 10);
+        }
+        if (last < first || last >= AFFINITY_MAX_CPUS) {
+            return false;
+        }
+        for (long cpu = first; cpu <= last && *n < max; cpu++) {
+            bool seen = false;
+            for (int i = 0; i < *n; i++) {
+                seen = seen || cpus[i] == cpu;
+            }
+            if (!seen) {
+                cpus[(*n)++] = (int) cpu;
+            }
+        }
+        p = end;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return true;
+}
+
+// Append the CPUs in the list that the sysfs file at path holds.
+// Returns false if there is no such file.
+static bool parse_file(const char *path, int *cpus, int *n, int max) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    char buf[4096];
+    bool ok = fgets(buf, sizeof(buf), f) != NULL && parse_list(buf, cpus, n, max);
+    fclose(f);
+    return ok;
+}
+
+int affinity_parse(const char *list, int *cpus, int max) {
+    int n = 0;
+    if (strcmp(list, "all") == 0) {
+        // node by node, then whatever no node claimed
+        char path[64];
+        for (int node = 0; node < MAX_NODES; node++) {
+            sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+            parse_file(path, cpus, &n, max);
+        }
+        parse_file("/sys/devices/system/cpu/online", cpus, &n, max);
+    } else if (!parse_list(list, cpus, &n, max)) {
+        return -1;
+    }
+    return n > 0 ? n : -1;
+}
+
+int affinity_pin(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
+}
+
+int affinity_node(int cpu) {
+    char path[96];
+    for (int node = 0; node < MAX_NODES; node++) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpu%d", node, cpu);
+        if (access(path, F_OK) == 0) {
+            return node;
+        }
+    }
+    return -1;
+}
+
+int affinity_steer(int fd, int cpu) {
+    return setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
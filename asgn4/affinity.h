@@ -0,0 +1,62 @@
+/**
+ * @File affinity.h
+ *
+ * CPU and NUMA placement of threads.  A thread that is pinned to a CPU
+ * before it allocates its buffers gets them on that CPU's NUMA node
+ * (the kernel places a page on the node of the CPU that first touches
+ * it), so pinning a worker at its start also keeps its memory local.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/** @brief The most CPUs that a list may name.
+ */
+#define AFFINITY_MAX_CPUS 1024
+
+/** @brief Parse a list of CPUs.
+ *
+ *  @param list a CPU list in the kernel's format (e.g., "0-3,8,10-11"),
+ *         or "all" for every online CPU, grouped by NUMA node (so that
+ *         consecutive entries share a node for as long as they can).
+ *
+ *  @param cpus a place to put the CPUs, in the order they are listed.
+ *
+ *  @param max the most CPUs to put in cpus.
+ *
+ *  @return the number of CPUs, or -1 if list is malformed or names no
+ *          CPU.
+ */
+int affinity_parse(const char *list, int *cpus, int max);
+
+/** @brief Pin the calling thread to one CPU.  Threads that it creates
+ *         afterwards start out pinned to the same CPU.
+ *
+ *  @param cpu the CPU.
+ *
+ *  @return 0, or -1 if the thread can't run on cpu.
+ */
+int affinity_pin(int cpu);
+
+/** @brief The NUMA node that a CPU belongs to.
+ *
+ *  @param cpu the CPU.
+ *
+ *  @return the node, or -1 if it can't be found (e.g., the kernel has
+ *          no NUMA support).
+ */
+int affinity_node(int cpu);
+
+/** @brief Steer the connections of a SO_REUSEPORT listener to a CPU:
+ *         among the listeners on the port, the kernel prefers the one
+ *         whose incoming CPU is the CPU that received the connection's
+ *         packets (SO_INCOMING_CPU).
+ *
+ *  @param fd the listener socket.
+ *
+ *  @param cpu the CPU whose connections it should get.
+ *
+ *  @return 0, or -1 if the option can't be set.
+ */
+int affinity_steer(int fd, int cpu);
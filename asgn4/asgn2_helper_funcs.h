@@ -35,6 +35,20 @@ typedef struct {
  */
 int listener_init(Listener_Socket *sock, int port);
 
+/** @brief Initializes a listener socket like listener_init, but with
+ *         SO_REUSEPORT set, so that several sockets (one per thread)
+ *         can listen on the same port.  The kernel spreads new
+ *         connections across them.
+ *
+ *  @param sock The Listener_Socket to initialize.
+ *
+ *  @param port The port on which to listen.
+ *
+ *  @return 0, indicating success, or -1, indicating that it failed to
+ *          listen.
+ */
+int listener_init_reuseport(Listener_Socket *sock, int port);
+
 /** @brief Accept a new connection and initialize a 5 second timeout
  *
  *  @param sock The Listener_Socket from which to get the new
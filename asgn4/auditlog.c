@@ -0,0 +1,262 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "asgn2_helper_funcs.h"
+#include "auditlog.h"
+
+#define CACHE_LINE 64
+
+// lines per thread's ring (a power of two)
+#define RING_SIZE 1024
+// longest line, including its newline
+#define LINE_LEN 256
+// bytes that the logger gathers before each write
+#define BATCH_LEN (64 * 1024)
+
+typedef struct record {
+    uint64_t seq;
+    uint16_t len;
+    char line[LINE_LEN];
+} record;
+
+// A single-producer, single-consumer ring.  The owning thread advances
+// tail and the logger advances head; each sits on its own cache line.
+// A ring whose thread exited is released and reused by the next new
+// thread, which keeps its records in order.
+typedef struct ring {
+    alignas(CACHE_LINE) _Atomic uint64_t head;
+    alignas(CACHE_LINE) _Atomic uint64_t tail;
+    _Atomic bool owned;
+    struct ring *next; // in the log's list of rings; never removed
+    record slots[RING_SIZE];
+} ring;
+
+typedef struct auditlog {
+    int fd;
+    int interval; // milliseconds
+    alignas(CACHE_LINE) _Atomic uint64_t seq; // the next sequence number
+    _Atomic(ring *) rings;
+    pthread_key_t key; // releases a thread's ring when it exits
+
+    // consumer side: the logger thread, or a thread calling
+    // auditlog_flush(), holds mutex while it drains the rings
+    pthread_mutex_t mutex;
+    uint64_t next; // the next sequence number to write out
+    char batch[BATCH_LEN];
+    size_t batch_len;
+
+    int evfd; // wakes the logger early
+    _Atomic bool stop;
+    pthread_t logger;
+} auditlog;
+
+static __thread ring *my_ring = NULL;
+
+static void release_ring(void *r) {
+    atomic_store(&((ring *) r)->owned, false);
+}
+
+static void *logger_thread(void *arg);
+
+auditlog_t *auditlog_new(int fd, int interval) {
+    auditlog_t *log = malloc(sizeof(auditlog));
+    if (log == NULL) {
+        fprintf(stderr, "failed to create new audit log in auditlog_new()\n");
+        exit(1);
+    }
+    log->fd = fd;
+    log->interval = interval;
+    atomic_init(&log->seq, 0);
+    atomic_init(&log->rings, NULL);
+    atomic_init(&log->stop, false);
+    log->next = 0;
+    log->batch_len = 0;
+
+    int rc = pthread_key_create(&log->key, release_ring);
+    assert(!rc);
+    rc = pthread_mutex_init(&log->mutex, NULL);
+    assert(!rc);
+    (void) rc;
+
+    log->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (log->evfd < 0) {
+        fprintf(stderr, "failed to create eventfd in auditlog_new()\n");
+        exit(1);
+    }
+    if (pthread_create(&log->logger, NULL, logger_thread, log) != 0) {
+        fprintf(stderr, "failed to start logger thread in auditlog_new()\n");
+        exit(1);
+    }
+    return log;
+}
+
+// Find the calling thread's ring, claiming one on first use.
+static ring *get_ring(auditlog_t *log) {
+    if (my_ring != NULL) {
+        return my_ring;
+    }
+
+    // reuse the ring of a thread that exited
+    for (ring *r = atomic_load(&log->rings); r != NULL; r = r->next) {
+        bool owned = false;
+        if (!atomic_load(&r->owned) && atomic_compare_exchange_strong(&r->owned, &owned, true)) {
+            my_ring = r;
+            break;
+        }
+    }
+
+    if (my_ring == NULL) {
+        ring *r = aligned_alloc(CACHE_LINE, sizeof(ring));
+        if (r == NULL) {
+            fprintf(stderr, "failed to allocate ring in auditlog_write()\n");
+            exit(1);
+        }
+        atomic_init(&r->head, 0);
+        atomic_init(&r->tail, 0);
+        atomic_init(&r->owned, true);
+        r->next = atomic_load(&log->rings);
+        while (!atomic_compare_exchange_weak(&log->rings, &r->next, r)) {
+        }
+        my_ring = r;
+    }
+    pthread_setspecific(log->key, my_ring);
+    return my_ring;
+}
+
+static void wake_logger(auditlog_t *log) {
+    uint64_t one = 1;
+    ssize_t rc = write(log->evfd, &one, sizeof(one));
+    (void) rc;
+}
+
+void auditlog_write(auditlog_t *log, const char *fmt, ...) {
+    ring *r = get_ring(log);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    // Wait for room *before* taking a sequence number: the logger can
+    // only write a line out once every smaller number is published, so
+    // a numbered line must never wait on the logger.
+    while (tail - atomic_load_explicit(&r->head, memory_order_acquire) == RING_SIZE) {
+        wake_logger(log);
+        sched_yield();
+    }
+
+    record *rec = &r->slots[tail & (RING_SIZE - 1)];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(rec->line, LINE_LEN, fmt, args);
+    va_end(args);
+    if (n >= LINE_LEN) {
+        rec->line[LINE_LEN - 2] = '\n'; // truncated
+        n = LINE_LEN - 1;
+    }
+    rec->len = n < 0 ? 0 : n;
+    rec->seq = atomic_fetch_add_explicit(&log->seq, 1, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+
+    if (tail + 1 - atomic_load_explicit(&r->head, memory_order_relaxed) == RING_SIZE / 2) {
+        wake_logger(log);
+    }
+}
+
+static void write_batch(auditlog_t *log) {
+    if (log->batch_len > 0) {
+        write_all(log->fd, log->batch, log->batch_len);
+        log->batch_len = 0;
+    }
+}
+
+// Move the lines that can be written out (those up to the first
+// sequence number that isn't published yet) into the batch, writing
+// the batch whenever it fills.  Called with log->mutex held.
+static void drain(auditlog_t *log) {
+    bool progress = true;
+    while (progress) {
+        progress = false;
+        for (ring *r = atomic_load(&log->rings); r != NULL; r = r->next) {
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+            uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+            // each ring's records are in increasing order
+            while (head < tail && r->slots[head & (RING_SIZE - 1)].seq == log->next) {
+                record *rec = &r->slots[head & (RING_SIZE - 1)];
+                if (log->batch_len + rec->len > BATCH_LEN) {
+                    write_batch(log);
+                }
+                memcpy(log->batch + log->batch_len, rec->line, rec->len);
+                log->batch_len += rec->len;
+                log->next++;
+                head++;
+                progress = true;
+            }
+            atomic_store_explicit(&r->head, head, memory_order_release);
+        }
+    }
+}
+
+void auditlog_flush(auditlog_t *log) {
+    uint64_t end = atomic_load(&log->seq);
+    pthread_mutex_lock(&log->mutex);
+    drain(log);
+    // lines numbered before end but not yet published are being
+    // copied into their rings right now
+    while (log->next < end) {
+        sched_yield();
+        drain(log);
+    }
+    write_batch(log);
+    pthread_mutex_unlock(&log->mutex);
+}
+
+static void *logger_thread(void *arg) {
+    auditlog_t *log = arg;
+    struct pollfd pfd = { .fd = log->evfd, .events = POLLIN };
+
+    while (!atomic_load(&log->stop)) {
+        if (poll(&pfd, 1, log->interval) > 0) {
+            uint64_t count;
+            ssize_t rc = read(log->evfd, &count, sizeof(count));
+            (void) rc;
+        }
+        pthread_mutex_lock(&log->mutex);
+        drain(log);
+        write_batch(log);
+        pthread_mutex_unlock(&log->mutex);
+    }
+    return NULL;
+}
+
+void auditlog_delete(auditlog_t **log) {
+    if (log != NULL && *log != NULL) {
+        atomic_store(&(*log)->stop, true);
+        wake_logger(*log);
+        pthread_join((*log)->logger, NULL);
+        auditlog_flush(*log);
+
+        ring *r = atomic_load(&(*log)->rings);
+        while (r != NULL) {
+            ring *next = r->next;
+            free(r);
+            r = next;
+        }
+        // a thread that wrote must not find its (freed) ring again
+        my_ring = NULL;
+        pthread_key_delete((*log)->key);
+        pthread_mutex_destroy(&(*log)->mutex);
+        close((*log)->evfd);
+        free(*log);
+        *log = NULL;
+    }
+}
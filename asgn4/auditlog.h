@@ -0,0 +1,56 @@
+/**
+ * @File auditlog.h
+ *
+ * An asynchronous audit log.  Each thread formats its lines into its
+ * own lock-free ring buffer, and a logger thread writes them out in
+ * batches.  Every line is stamped with a global sequence number when it
+ * is written, and lines are output in sequence order, so a line written
+ * while holding a lock is output in the order in which the lock was
+ * held.
+ */
+
+#pragma once
+
+/** @struct auditlog_t
+ *
+ *  @brief This typedef renames the struct auditlog.
+ */
+typedef struct auditlog auditlog_t;
+
+/** @brief Dynamically allocates and initializes a new audit log, and
+ *         starts its logger thread.
+ *
+ *  @param fd the file descriptor that lines are written to.
+ *
+ *  @param interval the number of milliseconds between flushes.  A
+ *         thread whose ring buffer fills up wakes the logger early.
+ *
+ *  @return a pointer to a new auditlog_t
+ */
+auditlog_t *auditlog_new(int fd, int interval);
+
+/** @brief Stop the logger thread, write out every buffered line and
+ *         delete the log.  No thread may write to the log anymore.
+ *         fd is not closed.
+ *
+ *  @param log the log to be deleted.  *log is set to NULL.
+ */
+void auditlog_delete(auditlog_t **log);
+
+/** @brief Format a line into the calling thread's buffer.  Does not
+ *         block unless the buffer is full.
+ *
+ *  @param log the log.
+ *
+ *  @param fmt a printf-style format string for the line (including its
+ *         trailing newline), followed by its arguments.
+ */
+void auditlog_write(auditlog_t *log, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/** @brief Write out every line that was written before the call.  Safe
+ *         to call while other threads keep writing.
+ *
+ *  @param log the log.
+ */
+void auditlog_flush(auditlog_t *log);
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+
+#include "asgn2_helper_funcs.h"
+#include "buffered_socket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// the most bytes moved by one sendfile/splice call
+#define MAX_CHUNK (1 << 20)
+
+struct BufferedSocket {
+    char *buf; // always NUL-terminated after len bytes
+    char *line; // the copy that bs_read_until returns
+    uint16_t len; // number of buffered bytes
+    uint16_t cap; // maximum number of buffered bytes
+    int fd;
+};
+
+// Constructor
+BufferedSocket_t *bs_new(int fd, uint16_t cap) {
+    BufferedSocket_t *bs = (BufferedSocket_t *) malloc(sizeof(BufferedSocket_t));
+    if (bs == NULL) {
+        return NULL;
+    }
+    bs->fd = fd;
+    bs->buf = (char *) calloc(cap + 1, sizeof(char));
+    bs->line = (char *) malloc(cap + 1);
+    if (bs->buf == NULL || bs->line == NULL) {
+        free(bs->buf);
+        free(bs->line);
+        free(bs);
+        return NULL;
+    }
+    bs->len = 0;
+    bs->cap = cap;
+    return bs;
+}
+
+// Destructor
+void bs_delete(BufferedSocket_t **pbs) {
+    BufferedSocket_t *bs = *pbs;
+    free(bs->buf);
+    free(bs->line);
+    free(bs);
+    *pbs = NULL;
+}
+
+void bs_reset(BufferedSocket_t *bs, int fd) {
+    bs->fd = fd;
+    bs->len = 0;
+    memset(bs->buf, 0, bs->cap + 1);
+}
+
+int bs_get_fd(BufferedSocket_t *bs) {
+    return bs->fd;
+}
+
+// Drop the first n buffered bytes.
+static void bs_shift(BufferedSocket_t *bs, uint16_t n) {
+    memmove(bs->buf, bs->buf + n, bs->len - n);
+    bs->len -= n;
+    memset(bs->buf + bs->len, 0, bs->cap + 1 - bs->len);
+}
+
+// Copy the first n buffered bytes into bs->line and consume them.
+static void bs_fill_and_shift(BufferedSocket_t *bs, char **buf, uint16_t n) {
+    *buf = bs->line;
+    memcpy(*buf, bs->buf, n);
+    (*buf)[n] = 0;
+    bs_shift(bs, n);
+}
+
+BufferedResult bs_read_until(BufferedSocket_t *bs, char **buf, uint16_t *len, const char *string) {
+    size_t slen = strlen(string);
+    if (slen > bs->cap) {
+        return BR_ERROR;
+    }
+
+    char *found = strstr(bs->buf, string);
+    ssize_t rc = 1;
+    while (found == NULL && rc > 0 && bs->len < bs->cap) {
+        rc = read(bs->fd, bs->buf + bs->len, bs->cap - bs->len);
+        if (rc > 0) {
+            bs->len += rc;
+            found = strstr(bs->buf, string);
+        }
+    }
+
+    if (found == NULL) {
+        return BR_ERROR;
+    }
+
+    *len = (found - bs->buf) + slen;
+    bs_fill_and_shift(bs, buf, *len);
+    return BR_OK;
+}
+
+BufferedResult bs_fill(BufferedSocket_t *bs) {
+    if (bs->len == bs->cap) {
+        return BR_FULL;
+    }
+
+    ssize_t rc = recv(bs->fd, bs->buf + bs->len, bs->cap - bs->len, MSG_DONTWAIT);
+    if (rc > 0) {
+        bs->len += rc;
+        return BR_OK;
+    } else if (rc == 0) {
+        return BR_CLOSED;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        return BR_AGAIN;
+    }
+    return BR_ERROR;
+}
+
+uint16_t bs_buffered(BufferedSocket_t *bs) {
+    return bs->len;
+}
+
+bool bs_contains(BufferedSocket_t *bs, const char *string) {
+    return strstr(bs->buf, string) != NULL;
+}
+
+BufferedResult bs_sendbuf(BufferedSocket_t *bs, const char *buf, uint16_t len) {
+    ssize_t rc = write_all(bs->fd, (char *) buf, len);
+    return rc < 0 ? BR_ERROR : BR_OK;
+}
+
+BufferedResult bs_sendbuf_more(BufferedSocket_t *bs, const char *buf, uint16_t len) {
+    while (len > 0) {
+        ssize_t rc = send(bs->fd, buf, len, MSG_MORE);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return BR_ERROR;
+        }
+        buf += rc;
+        len -= rc;
+    }
+    return BR_OK;
+}
+
+BufferedResult bs_sendvec(BufferedSocket_t *bs, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t rc = writev(bs->fd, iov, iovcnt);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return BR_ERROR;
+        }
+        // skip what was written
+        while (iovcnt > 0 && (size_t) rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+    return BR_OK;
+}
+
+// Each thread keeps one pipe around for splicing socket data into files.
+static __thread int splice_pipe[2] = { -1, -1 };
+
+static void close_splice_pipe(void) {
+    close(splice_pipe[0]);
+    close(splice_pipe[1]);
+    splice_pipe[0] = -1;
+    splice_pipe[1] = -1;
+}
+
+// Copy count bytes of the file fd, starting at off, to the socket
+// through a userspace buffer, with pread so fd's offset is left alone.
+static BufferedResult pread_send(int sock, int fd, off_t off, uint64_t count) {
+    char buf[4096];
+    while (count > 0) {
+        ssize_t n = pread(fd, buf, count < sizeof(buf) ? count : sizeof(buf), off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0 || write_all(sock, buf, n) < 0) {
+            return BR_ERROR;
+        }
+        off += n;
+        count -= n;
+    }
+    return BR_OK;
+}
+
+// Zero-copy: the kernel moves the file's pages straight to the socket.
+// Falls back to copying through a userspace buffer if the file can't
+// be sent with sendfile (e.g., a filesystem without support for it).
+// The offset is passed explicitly, so several threads can send from one
+// shared descriptor at the same time.
+BufferedResult bs_sendfile(BufferedSocket_t *bs, int fd, uint64_t offset, uint64_t count) {
+    off_t off = offset;
+    while (count > 0) {
+        ssize_t rc = sendfile(bs->fd, fd, &off, count < MAX_CHUNK ? count : MAX_CHUNK);
+        if (rc > 0) {
+            count -= rc;
+        } else if (rc == 0) {
+            // the file is shorter than count: the response can't be
+            // finished, and closing the connection flushes what was sent
+            return BR_ERROR;
+        } else if (errno == EINTR) {
+            continue;
+        } else if (off == (off_t) offset && (errno == EINVAL || errno == ENOSYS)) {
+            return pread_send(bs->fd, fd, off, count);
+        } else {
+            return BR_ERROR;
+        }
+    }
+    return BR_OK;
+}
+
+// Zero-copy: splice count bytes from the socket into a pipe and from
+// the pipe into the file, so they never cross into userspace.
+// Returns the number of bytes moved, or -1 on error (with nothing
+// moved if errno is EINVAL, i.e., the file doesn't support splice).
+static ssize_t splice_to_file(int sock, int fd, uint64_t count) {
+    if (splice_pipe[0] < 0 && pipe2(splice_pipe, O_CLOEXEC) < 0) {
+        return -1;
+    }
+
+    uint64_t moved = 0;
+    while (moved < count) {
+        size_t want = count - moved < MAX_CHUNK ? count - moved : MAX_CHUNK;
+        ssize_t in = splice(sock, NULL, splice_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == 0) {
+            break; // the client hung up
+        } else if (in < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (moved > 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        while (in > 0) {
+            ssize_t out = splice(splice_pipe[0], NULL, fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            } else if (out <= 0) {
+                // data is stuck in the pipe: don't reuse it
+                int e = moved == 0 && errno == EINVAL ? EINVAL : EIO;
+                close_splice_pipe();
+                errno = e;
+                return -1;
+            }
+            in -= out;
+            moved += out;
+        }
+    }
+    return moved;
+}
+
+BufferedResult bs_recvfile(BufferedSocket_t *bs, int fd, uint64_t count) {
+    ssize_t rc = 1;
+
+    // the start of the body may already be sitting in the buffer
+    if (bs->len > 0 && count > 0) {
+        uint16_t n = count < bs->len ? (uint16_t) count : bs->len;
+        rc = write_all(fd, bs->buf, n);
+        if (rc > 0) {
+            bs_shift(bs, n);
+            count -= n;
+        }
+    }
+
+    if (rc > 0 && count > 0) {
+        rc = splice_to_file(bs->fd, fd, count);
+        if (rc < 0 && errno == EINVAL) {
+            // nothing was moved; copy through a userspace buffer instead
+            rc = pass_bytes(bs->fd, fd, count);
+        }
+        if (rc >= 0 && (uint64_t) rc < count) {
+            return BR_CLOSED; // the client hung up before the end
+        }
+    }
+    return rc < 0 ? BR_ERROR : BR_OK;
+}
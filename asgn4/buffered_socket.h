@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+typedef struct BufferedSocket BufferedSocket_t;
+
+typedef enum {
+    BR_OK = 0, // the operation succeeded
+    BR_ERROR, // the operation failed (or timed out)
+    BR_AGAIN, // no data is available yet (non-blocking reads only)
+    BR_CLOSED, // the peer closed the connection
+    BR_FULL, // the buffer is full
+} BufferedResult;
+
+// Constructor: buffer up to cap bytes that are read from fd. Returns
+// NULL if it runs out of memory.
+BufferedSocket_t *bs_new(int fd, uint16_t cap);
+
+// Destructor
+void bs_delete(BufferedSocket_t **bs);
+
+// Empty the buffer and make bs read from and write to another socket,
+// so its buffers are reused for a new connection.
+void bs_reset(BufferedSocket_t *bs, int fd);
+
+// Return the socket that bs reads from and writes to.
+int bs_get_fd(BufferedSocket_t *bs);
+
+// Read from the socket until the buffer contains string. On success,
+// *buf points to a NUL-terminated copy of everything up to and
+// including string (of length *len), which is consumed from the
+// buffer. The copy is owned by bs and valid until the next call.
+BufferedResult bs_read_until(BufferedSocket_t *bs, char **buf, uint16_t *len, const char *string);
+
+// Read whatever the socket has available without blocking.
+//
+// Returns BR_OK if bytes were buffered, BR_AGAIN if the socket had
+// nothing to read, BR_CLOSED on end-of-file, BR_FULL if there is no
+// room left in the buffer, and BR_ERROR otherwise.
+BufferedResult bs_fill(BufferedSocket_t *bs);
+
+// Return the number of buffered (unconsumed) bytes.
+uint16_t bs_buffered(BufferedSocket_t *bs);
+
+// Return whether the buffered (unconsumed) bytes contain string.
+bool bs_contains(BufferedSocket_t *bs, const char *string);
+
+// Write len bytes from buf to the socket.
+BufferedResult bs_sendbuf(BufferedSocket_t *bs, const char *buf, uint16_t len);
+
+// Write len bytes from buf to the socket, telling the kernel that more
+// data follows right away (MSG_MORE), so a header and the body sent
+// after it are not split into a short segment that waits on an ACK.
+BufferedResult bs_sendbuf_more(BufferedSocket_t *bs, const char *buf, uint16_t len);
+
+// Write all of the iovcnt buffers in iov to the socket, with as few
+// system calls as possible. iov is modified.
+BufferedResult bs_sendvec(BufferedSocket_t *bs, struct iovec *iov, int iovcnt);
+
+// Write count bytes of the file fd, starting at offset, to the socket,
+// with sendfile(2) when the file supports it. fd's file offset is
+// neither used nor moved, so fd may be shared with other threads.
+BufferedResult bs_sendfile(BufferedSocket_t *bs, int fd, uint64_t offset, uint64_t count);
+
+// Write count bytes from the socket (starting with anything that is
+// already buffered) into the file fd, with splice(2) through a pipe
+// when the file supports it. Returns BR_CLOSED if the client hung up
+// before count bytes arrived.
+BufferedResult bs_recvfile(BufferedSocket_t *bs, int fd, uint64_t count);
@@ -0,0 +1,226 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "classq.h"
+
+// A bounded FIFO of one class, with what the scheduler keeps about it.
+typedef struct ring {
+    int length; // number of elements in the ring
+    int front; // index of the front element
+    void **elem;
+    int weight;
+    int reserved; // workers that the class has to itself
+    int busy; // workers busy with an element of the class
+    int current; // smooth weighted round-robin credit
+} ring;
+
+typedef struct classq {
+    int capacity; // capacity of each ring
+    ring rings[CLASS_COUNT];
+    int workers; // workers that take elements
+    int busy; // workers busy with any element
+
+    // everything is protected by one mutex: a pop looks at every class
+    // and the workers' counts at once. Idle workers wait on cv_work,
+    // a pusher facing a full ring waits on cv_space
+    pthread_mutex_t mutex;
+    pthread_cond_t cv_work;
+    pthread_cond_t cv_space;
+    int idle; // workers waiting on cv_work
+} classq;
+
+classq_t *classq_new(int capacity, const int weights[CLASS_COUNT], const int reserved[CLASS_COUNT]) {
+    classq_t *cq = malloc(sizeof(classq));
+    if (cq == NULL) {
+        fprintf(stderr, "failed to create new class queue in classq_new()\n");
+        exit(1);
+    }
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        ring *r = &cq->rings[c];
+        r->elem = calloc(capacity, sizeof(void *));
+        if (r->elem == NULL) {
+            fprintf(stderr, "failed to allocate ring in classq_new()\n");
+            exit(1);
+        }
+        r->length = 0;
+        r->front = 0;
+        r->weight = weights[c] > 0 ? weights[c] : 1;
+        r->reserved = reserved[c] > 0 ? reserved[c] : 0;
+        r->busy = 0;
+        r->current = 0;
+    }
+
+    int rc;
+    rc = pthread_mutex_init(&cq->mutex, NULL);
+    assert(!rc);
+    rc = pthread_cond_init(&cq->cv_work, NULL);
+    assert(!rc);
+    rc = pthread_cond_init(&cq->cv_space, NULL);
+    assert(!rc);
+    (void) rc;
+
+    cq->capacity = capacity;
+    cq->workers = 0;
+    cq->busy = 0;
+    cq->idle = 0;
+    return cq;
+}
+
+void classq_delete(classq_t **cq) {
+    if (cq != NULL && *cq != NULL) {
+        for (int c = 0; c < CLASS_COUNT; c++) {
+            free((*cq)->rings[c].elem);
+        }
+        pthread_mutex_destroy(&(*cq)->mutex);
+        pthread_cond_destroy(&(*cq)->cv_work);
+        pthread_cond_destroy(&(*cq)->cv_space);
+        free(*cq);
+        *cq = NULL;
+    }
+}
+
+void classq_set_workers(classq_t *cq, int workers) {
+    if (cq == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cq->mutex);
+    cq->workers = workers;
+    pthread_mutex_unlock(&cq->mutex);
+    // more workers may make more classes eligible
+    pthread_cond_broadcast(&cq->cv_work);
+}
+
+// Push elem onto r, called with cq->mutex held (which is released):
+// while r is full, waits for room if wait is set, else fails.
+static bool push(classq_t *cq, ring *r, void *elem, bool wait) {
+    while (r->length == cq->capacity) {
+        if (!wait) {
+            pthread_mutex_unlock(&cq->mutex);
+            return false;
+        }
+        pthread_cond_wait(&cq->cv_space, &cq->mutex);
+    }
+    r->elem[(r->front + r->length) % cq->capacity] = elem;
+    r->length++;
+    bool wake = cq->idle > 0;
+    pthread_mutex_unlock(&cq->mutex);
+    if (wake) {
+        pthread_cond_signal(&cq->cv_work);
+    }
+    return true;
+}
+
+bool classq_push(classq_t *cq, void *elem, classq_class_t cls) {
+    if (cq == NULL || elem == NULL || cls >= CLASS_COUNT) {
+        return false;
+    }
+    pthread_mutex_lock(&cq->mutex);
+    return push(cq, &cq->rings[cls], elem, true);
+}
+
+bool classq_try_push(classq_t *cq, void *elem, classq_class_t cls) {
+    if (cq == NULL || elem == NULL || cls >= CLASS_COUNT) {
+        return false;
+    }
+    pthread_mutex_lock(&cq->mutex);
+    return push(cq, &cq->rings[cls], elem, false);
+}
+
+// Whether a worker may take an element of cls: the idle workers that
+// would be left must cover the other classes' reservations that their
+// busy workers don't fill, with at least one worker never reserved.
+// Every worker sees the same answer, so waking any one of them is
+// enough when it changes.
+static bool eligible(classq_t *cq, int cls) {
+    int owed = 0;
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        ring *r = &cq->rings[c];
+        if (c != cls && r->busy < r->reserved) {
+            owed += r->reserved - r->busy;
+        }
+    }
+    if (owed > cq->workers - 1) {
+        owed = cq->workers - 1;
+    }
+    return cq->workers - cq->busy - 1 >= owed;
+}
+
+// Pick the class of the next element by smooth weighted round-robin
+// among the classes that have elements and are eligible: each gains its
+// weight in credit, and the one with the most pays back the total.
+// Returns -1 if there is none.
+static int pick(classq_t *cq) {
+    int best = -1;
+    int total = 0;
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        ring *r = &cq->rings[c];
+        if (r->length > 0 && eligible(cq, c)) {
+            r->current += r->weight;
+            total += r->weight;
+            if (best < 0 || r->current > cq->rings[best].current) {
+                best = c;
+            }
+        }
+    }
+    if (best >= 0) {
+        cq->rings[best].current -= total;
+    }
+    return best;
+}
+
+bool classq_pop(classq_t *cq, void **elem, classq_class_t *cls) {
+    if (cq == NULL || elem == NULL || cls == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&cq->mutex);
+    int c;
+    while ((c = pick(cq)) < 0) {
+        cq->idle++;
+        pthread_cond_wait(&cq->cv_work, &cq->mutex);
+        cq->idle--;
+    }
+    ring *r = &cq->rings[c];
+    *elem = r->elem[r->front];
+    r->front = (r->front + 1) % cq->capacity;
+    r->length--;
+    r->busy++;
+    cq->busy++;
+    pthread_mutex_unlock(&cq->mutex);
+    *cls = c;
+    pthread_cond_broadcast(&cq->cv_space);
+    return true;
+}
+
+void classq_done(classq_t *cq, classq_class_t cls) {
+    if (cq == NULL || cls >= CLASS_COUNT) {
+        return;
+    }
+    pthread_mutex_lock(&cq->mutex);
+    cq->rings[cls].busy--;
+    cq->busy--;
+    // a worker more is free: an element that was held back for the
+    // reservations may be taken now
+    bool wake = cq->idle > 0;
+    pthread_mutex_unlock(&cq->mutex);
+    if (wake) {
+        pthread_cond_signal(&cq->cv_work);
+    }
+}
+
+int classq_length(classq_t *cq, classq_class_t cls) {
+    if (cq == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&cq->mutex);
+    int length = 0;
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        if (cls == CLASS_COUNT || cls == (classq_class_t) c) {
+            length += cq->rings[c].length;
+        }
+    }
+    pthread_mutex_unlock(&cq->mutex);
+    return length;
+}
@@ -0,0 +1,125 @@
+/**
+ * @File classq.h
+ *
+ * A dispatch queue with classes of work.  Each class has its own
+ * bounded FIFO; workers take the next element from the classes in
+ * proportion to their weights, and some workers can be reserved for a
+ * class, so that a burst of one class (e.g., large transfers) can
+ * neither take every worker nor starve the others' queues.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/** @brief The classes of work.
+ */
+typedef enum {
+    CLASS_SMALL, // requests whose response or body is known to be small
+    CLASS_LARGE, // requests whose response or body is known to be large
+    CLASS_UNKNOWN, // requests of a size that is not known up front
+    CLASS_COUNT,
+} classq_class_t;
+
+/** @struct classq_t
+ *
+ *  @brief This typedef renames the struct classq.
+ */
+typedef struct classq classq_t;
+
+/** @brief Dynamically allocates and initializes a new class queue.
+ *
+ *  @param capacity the maximum number of elements of each class.
+ *
+ *  @param weights how many elements of each class are taken, relative
+ *         to the others, while several classes have elements waiting
+ *         (values below 1 count as 1).
+ *
+ *  @param reserved how many workers each class has to itself: a worker
+ *         does not take an element of one class if that would leave
+ *         fewer idle workers than the other classes' reservations that
+ *         their busy workers don't already fill.  At least one worker is
+ *         never reserved.
+ *
+ *  @return a pointer to a new classq_t
+ */
+classq_t *classq_new(int capacity, const int weights[CLASS_COUNT], const int reserved[CLASS_COUNT]);
+
+/** @brief Delete a class queue and free all of its memory.
+ *
+ *  @param cq the queue to be deleted.  *cq is set to NULL.
+ */
+void classq_delete(classq_t **cq);
+
+/** @brief Set the number of workers that take elements, which the
+ *         reservations are counted against.
+ *
+ *  @param cq the queue.
+ *
+ *  @param workers the number of workers.
+ */
+void classq_set_workers(classq_t *cq, int workers);
+
+/** @brief Push an element of a class.  Blocks while that class's queue
+ *         is full.
+ *
+ *  @param cq the queue.
+ *
+ *  @param elem the element to push.
+ *
+ *  @param cls the element's class.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless cq or elem is NULL.
+ */
+bool classq_push(classq_t *cq, void *elem, classq_class_t cls);
+
+/** @brief Push an element of a class, like classq_push, unless that
+ *         class's queue is full.
+ *
+ *  @param cq the queue.
+ *
+ *  @param elem the element to push.
+ *
+ *  @param cls the element's class.
+ *
+ *  @return true if elem was pushed, false if its class's queue is full
+ *          (or cq or elem is NULL).
+ */
+bool classq_try_push(classq_t *cq, void *elem, classq_class_t cls);
+
+/** @brief Take the next element for a worker, which counts as busy with
+ *         its class until it calls classq_done.  Blocks until there is
+ *         an element that the worker may take.
+ *
+ *  @param cq the queue.
+ *
+ *  @param elem a place to assign the popped element.
+ *
+ *  @param cls a place to assign the element's class.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless cq, elem or cls is NULL.
+ */
+bool classq_pop(classq_t *cq, void **elem, classq_class_t *cls);
+
+/** @brief Tell the queue that a worker is done with an element that it
+ *         popped.
+ *
+ *  @param cq the queue.
+ *
+ *  @param cls the element's class.
+ */
+void classq_done(classq_t *cq, classq_class_t cls);
+
+/** @brief The number of elements waiting in a class, or in all classes,
+ *         for monitoring.  It may be out of date as soon as it is
+ *         returned.
+ *
+ *  @param cq the queue.
+ *
+ *  @param cls the class, or CLASS_COUNT for all of them.
+ *
+ *  @return the number of elements, or 0 if cq is NULL.
+ */
+int classq_length(classq_t *cq, classq_class_t cls);
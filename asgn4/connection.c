@@ -0,0 +1,1004 @@
+#define _GNU_SOURCE
+
+#include "buffered_socket.h"
+#include "connection.h"
+#include "debug.h"
+#include "protocol.h"
+#include "response.h"
+#include "request.h"
+#include "uring.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Conn {
+    const Request_t *type;
+    BufferedSocket_t *bs;
+    char *URI;
+
+    uint32_t count; // requests completed before this one
+    bool body_read; // the request body was consumed by conn_recv_file
+    bool failed; // a send or receive failed
+    bool last; // responses carry "Connection: close"
+
+    // the validators of the file that the response is about
+    bool validated;
+    char etag[64];
+    time_t mtime;
+
+#define X(str, longstr, name) char *name;
+    SAVE_HEADERS
+#undef X
+
+    // the URI and the saved header values point into strings, which the
+    // header block always fits in
+    char strings[MAX_HEADER_LEN + 1];
+    uint16_t strings_len;
+
+    struct Conn *next_free; // on a free list
+};
+
+// Connections are recycled instead of freed: conn_delete puts one (with
+// its buffered socket) on the calling thread's free list, and conn_new
+// takes one from there. A thread whose list grows past CONN_CACHE (a
+// worker, which deletes the connections that the poller creates) moves
+// half of it to a shared depot under one lock, and a thread whose list
+// is empty (the poller) takes half a list's worth from the depot, so
+// the steady state allocates nothing and takes the lock once per
+// batch. The depot keeps up to CONN_DEPOT connections; more are freed.
+#define CONN_CACHE 64
+#define CONN_DEPOT 1024
+
+static __thread conn_t *free_conns = NULL;
+static __thread int num_free = 0;
+static __thread bool cache_registered = false;
+// a thread's buffer for streamed bodies (conn_send_stream), allocated
+// by its first stream and kept until the thread exits
+static __thread char *stream_buf = NULL;
+static pthread_mutex_t depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static conn_t *depot = NULL;
+static int depot_len = 0;
+// moves a thread's free list to the depot (and frees its stream
+// buffer) when the thread exits
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// Move up to n connections from the front of *from to the front of
+// *to. Returns how many were moved.
+static int move_conns(conn_t **from, conn_t **to, int n) {
+    int moved = 0;
+    while (moved < n && *from != NULL) {
+        conn_t *conn = *from;
+        *from = conn->next_free;
+        conn->next_free = *to;
+        *to = conn;
+        moved++;
+    }
+    return moved;
+}
+
+// Return the free list of an exiting thread to the depot (or free it),
+// and free the thread's stream buffer.
+static void flush_cache(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&depot_mutex);
+    depot_len += move_conns(&free_conns, &depot, CONN_DEPOT - depot_len);
+    pthread_mutex_unlock(&depot_mutex);
+    while (free_conns != NULL) {
+        conn_t *conn = free_conns;
+        free_conns = conn->next_free;
+        bs_delete(&conn->bs);
+        free(conn);
+    }
+    num_free = 0;
+    free(stream_buf);
+    stream_buf = NULL;
+}
+
+static void make_cache_key(void) {
+    int rc = pthread_key_create(&cache_key, flush_cache);
+    assert(!rc);
+    (void) rc;
+}
+
+// Make sure flush_cache runs when the calling thread exits.
+static void register_thread(void) {
+    if (!cache_registered) {
+        pthread_once(&cache_once, make_cache_key);
+        pthread_setspecific(cache_key, &free_conns);
+        cache_registered = true;
+    }
+}
+
+// Constructor
+conn_t *conn_new(int connfd) {
+    if (free_conns == NULL) {
+        pthread_mutex_lock(&depot_mutex);
+        int moved = move_conns(&depot, &free_conns, CONN_CACHE / 2);
+        depot_len -= moved;
+        pthread_mutex_unlock(&depot_mutex);
+        num_free += moved;
+    }
+
+    conn_t *conn = free_conns;
+    if (conn != NULL) {
+        free_conns = conn->next_free;
+        num_free--;
+        bs_reset(conn->bs, connfd);
+    } else {
+        conn = (conn_t *) malloc(sizeof(conn_t));
+        if (conn == NULL) {
+            fprintf(stderr, "failed to allocate a connection in conn_new()\n");
+            exit(1);
+        }
+        conn->bs = bs_new(connfd, MAX_HEADER_LEN + 1);
+        if (conn->bs == NULL) {
+            fprintf(stderr, "failed to allocate a socket buffer in conn_new()\n");
+            exit(1);
+        }
+    }
+
+    conn->type = &REQUEST_UNSUPPORTED;
+    conn->URI = NULL;
+    conn->strings_len = 0;
+    conn->next_free = NULL;
+    conn->count = 0;
+    conn->body_read = false;
+    conn->failed = false;
+    conn->last = false;
+    conn->validated = false;
+
+#define X(str, longstr, name) conn->name = NULL;
+    SAVE_HEADERS
+#undef X
+
+    return conn;
+}
+
+// Forget everything that was parsed out of the current request.
+static void conn_clear(conn_t *conn) {
+    conn->URI = NULL;
+    conn->strings_len = 0;
+
+#define X(str, longstr, name) conn->name = NULL;
+    SAVE_HEADERS
+#undef X
+}
+
+// Copy s into the connection's strings, for as long as this request is
+// being handled. Returns NULL if it does not fit.
+static char *save_string(conn_t *conn, const char *s) {
+    size_t len = strlen(s) + 1;
+    if (conn->strings_len + len > sizeof(conn->strings)) {
+        return NULL;
+    }
+    char *copy = conn->strings + conn->strings_len;
+    memcpy(copy, s, len);
+    conn->strings_len += len;
+    return copy;
+}
+
+// Destructor: the connection goes on the calling thread's free list
+void conn_delete(conn_t **ppconn) {
+    conn_t *pconn = *ppconn;
+    conn_clear(pconn);
+
+    register_thread();
+    pconn->next_free = free_conns;
+    free_conns = pconn;
+    num_free++;
+
+    if (num_free > CONN_CACHE) {
+        conn_t *spill = NULL;
+        num_free -= move_conns(&free_conns, &spill, CONN_CACHE / 2);
+        pthread_mutex_lock(&depot_mutex);
+        depot_len += move_conns(&spill, &depot, CONN_DEPOT - depot_len);
+        pthread_mutex_unlock(&depot_mutex);
+        while (spill != NULL) {
+            conn_t *conn = spill;
+            spill = conn->next_free;
+            bs_delete(&conn->bs);
+            free(conn);
+        }
+    }
+    *ppconn = NULL;
+}
+
+void conn_reset(conn_t *conn) {
+    conn_clear(conn);
+    conn->type = &REQUEST_UNSUPPORTED;
+    conn->count++;
+    conn->body_read = false;
+    conn->validated = false;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Parsing code.
+//
+// Helper functions:
+
+// The request line and headers are scanned by hand rather than with
+// regexec, which allocates on every call. The grammar is in protocol.h.
+
+static bool is_method(int c) {
+    return isalpha(c);
+}
+
+static bool is_name(int c) {
+    return isalnum(c) || c == '.' || c == '-';
+}
+
+static bool is_value(int c) {
+    return c >= ' ' && c <= '~';
+}
+
+// Length of the run of characters at s that satisfy in, if it is 1 to
+// max long; 0 otherwise.
+static int span(const char *s, bool (*in)(int), int max) {
+    int n = 0;
+    while (n <= max && in((unsigned char) s[n])) {
+        n++;
+    }
+    return n <= max ? n : 0;
+}
+
+// Split a request line into its method, URI (without the '/') and
+// version, each NUL-terminated in place. Returns false if the line is
+// malformed.
+static bool split_request_line(char *line, char **type, char **fname, char **ver) {
+    int type_len = span(line, is_method, MAX_METHOD_LEN);
+    char *p = line + type_len;
+    if (type_len == 0 || p[0] != ' ' || p[1] != '/') {
+        return false;
+    }
+    int fname_len = span(p + 2, is_name, MAX_URI_LEN);
+    char *v = p + 2 + fname_len;
+    if (fname_len == 0 || v[0] != ' ') {
+        return false;
+    }
+    v++;
+    // HTTP/[0-9].[0-9], where '.' is any character
+    if (strncmp(v, "HTTP/", 5) || !isdigit((unsigned char) v[5]) || v[6] == '\0'
+        || !isdigit((unsigned char) v[7]) || strcmp(v + 8, "\r\n")) {
+        return false;
+    }
+
+    *type = line;
+    *fname = p + 2;
+    *ver = v;
+    line[type_len] = 0;
+    v[-1] = 0;
+    v[8] = 0;
+    return true;
+}
+
+// Split a header line into its key and value, each NUL-terminated in
+// place. Returns false if the line is malformed.
+static bool split_header(char *line, char **key, char **value) {
+    int key_len = span(line, is_name, MAX_KEY_LEN);
+    if (key_len == 0 || line[key_len] != ':' || line[key_len + 1] != ' ') {
+        return false;
+    }
+    char *v = line + key_len + 2;
+    int value_len = span(v, is_value, MAX_VALUE_LEN);
+    if (value_len == 0 || strcmp(v + value_len, "\r\n")) {
+        return false;
+    }
+
+    *key = line;
+    *value = v;
+    line[key_len] = 0;
+    v[value_len] = 0;
+    return true;
+}
+
+static const Response_t *parse_request_line(conn_t *conn) {
+
+    char *buffer;
+    uint16_t buff_len;
+    const Response_t *res = NULL;
+    BufferedResult br;
+
+    br = bs_read_until(conn->bs, &buffer, &buff_len, "\r\n");
+    if (br == BR_OK) {
+        char *type, *fname, *ver;
+
+        // Parse the request type.
+        if (!split_request_line(buffer, &type, &fname, &ver)) {
+            res = &RESPONSE_BAD_REQUEST;
+            debug("Bad request_line (%s)\n", buffer);
+        } else {
+            for (int i = 0; i < NUM_REQUESTS; ++i) {
+                const Request_t *req = requests[i];
+                const char *rname = request_get_str(req);
+                if (strcmp(type, rname) == 0) {
+                    conn->type = req;
+                    break;
+                }
+            }
+
+            // save uri
+            conn->URI = save_string(conn, fname);
+
+            // check ver
+            if (conn->URI == NULL) {
+                res = &RESPONSE_BAD_REQUEST;
+            } else if (strcmp(ver, HTTP_VERSION)) {
+                res = &RESPONSE_VERSION_NOT_SUPPORTED;
+            }
+        }
+    } else {
+        res = &RESPONSE_BAD_REQUEST;
+    }
+
+    return res;
+}
+
+static const Response_t *parse_headers(conn_t *conn) {
+    char *buffer;
+    uint16_t buff_len;
+    const Response_t *res = NULL;
+    BufferedResult br;
+
+    br = bs_read_until(conn->bs, &buffer, &buff_len, "\r\n");
+    while (br == BR_OK && buff_len > 2) {
+        char *key, *value;
+
+        // Parse the request type.
+        if (!split_header(buffer, &key, &value)) {
+            res = &RESPONSE_BAD_REQUEST;
+            debug("Bad request_line (%s)\n", buffer);
+        } else {
+            debug("header %s: %s", key, value);
+
+#define X(str, longstr, name)                                                                      \
+    if (!strncmp(key, longstr, sizeof(longstr)) && conn->name == NULL)                             \
+        conn->name = save_string(conn, value);
+            SAVE_HEADERS
+#undef X
+        }
+
+        br = bs_read_until(conn->bs, &buffer, &buff_len, "\r\n");
+    }
+
+    return res;
+}
+
+// Parse the data from connection. Checks static correctness (i.e.,
+// that each field fits within our required bounds), but does not
+// check for semantic correctness (e.g., does not check that a URI is
+// not a directory).
+const Response_t *conn_parse(conn_t *conn) {
+
+    const Response_t *res = NULL;
+
+    res = parse_request_line(conn);
+    if (res == NULL) {
+        res = parse_headers(conn);
+
+        // the only transfer coding is chunked, and a body framed both
+        // ways could be read differently by a proxy in front of us
+        if (res == NULL && conn->te != NULL) {
+            if (strcasecmp(conn->te, "chunked") != 0) {
+                res = &RESPONSE_NOT_IMPLEMENTED;
+            } else if (conn->cl != NULL) {
+                res = &RESPONSE_BAD_REQUEST;
+            }
+        }
+
+        // check that puts have a content length (or a chunked body)!
+        if (res == NULL && conn_get_request(conn) == &REQUEST_PUT && conn->cl == NULL
+            && conn->te == NULL) {
+            res = &RESPONSE_BAD_REQUEST;
+        }
+    }
+
+    return res;
+}
+
+// Buffer whatever has arrived without blocking; parse once the whole
+// header block is here. conn_parse then never has to wait on the
+// socket, because every "\r\n" it looks for is already buffered.
+ParseStatus conn_try_parse(conn_t *conn, const Response_t **res) {
+    BufferedResult br;
+
+    // a pipelined request may already be buffered in full
+    if (!bs_contains(conn->bs, "\r\n\r\n")) {
+        do {
+            br = bs_fill(conn->bs);
+        } while (br == BR_OK);
+
+        if (br == BR_AGAIN && !bs_contains(conn->bs, "\r\n\r\n")) {
+            return PARSE_AGAIN;
+        } else if ((br == BR_CLOSED || br == BR_ERROR) && bs_buffered(conn->bs) == 0) {
+            conn->failed = true;
+            return PARSE_CLOSED;
+        }
+    }
+
+    if (bs_contains(conn->bs, "\r\n\r\n")) {
+        *res = conn_parse(conn);
+    } else {
+        // the header block does not fit in MAX_HEADER_LEN bytes, or the
+        // client hung up (or errored) in the middle of a request
+        *res = &RESPONSE_BAD_REQUEST;
+    }
+    return PARSE_DONE;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Functions that get stuff we might need elsewhere from a connection
+
+// Return the RequestType from parsing.
+const Request_t *conn_get_request(conn_t *conn) {
+    return conn->type;
+}
+
+// Return URI from parsing.
+char *conn_get_uri(conn_t *conn) {
+    return conn->URI;
+}
+
+char *conn_get_header(conn_t *conn, char *header) {
+
+#define X(str, longstr, name)                                                                      \
+    if (!strncmp(header, longstr, sizeof(longstr))) {                                              \
+        return conn->name;                                                                         \
+    } else
+    SAVE_HEADERS {
+        return NULL;
+    }
+#undef X
+
+    return NULL;
+}
+
+int conn_get_fd(conn_t *conn) {
+    return bs_get_fd(conn->bs);
+}
+
+uint32_t conn_get_count(conn_t *conn) {
+    return conn->count;
+}
+
+bool conn_wants_close(conn_t *conn) {
+    return conn->connection != NULL && strcasecmp(conn->connection, "close") == 0;
+}
+
+bool conn_reusable(conn_t *conn) {
+    if (conn->failed || conn->last) {
+        return false;
+    }
+    // an unread body would be parsed as the next request
+    return conn->body_read
+           || (conn->te == NULL && (conn->cl == NULL || strtoull(conn->cl, NULL, 10) == 0));
+}
+
+bool conn_idle(conn_t *conn) {
+    return bs_buffered(conn->bs) == 0;
+}
+
+void conn_set_last(conn_t *conn) {
+    conn->last = true;
+}
+
+void conn_set_validators(conn_t *conn, const struct stat *st) {
+    uint64_t ns = (uint64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    sprintf(conn->etag, "\"%lx-%lx-%lx\"", (unsigned long) st->st_ino, (unsigned long) st->st_size,
+        (unsigned long) ns);
+    conn->mtime = st->st_mtim.tv_sec;
+    conn->validated = true;
+}
+
+// Format t as an HTTP-date ("Sun, 06 Nov 1994 08:49:37 GMT").
+static void format_date(char *buf, size_t len, time_t t) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    strftime(buf, len, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// Parse an HTTP-date in the format that format_date writes (which is
+// what clients send back). Returns -1 if it is not one.
+static time_t parse_date(const char *s) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(s, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (end == NULL || *end != '\0') {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+// Return whether the comma-separated list of entity-tags contains etag.
+// The weak comparison ignores "W/" prefixes and lets "*" match; the
+// strong one matches only an identical tag that is not weak.
+static bool etag_matches(const char *list, const char *etag, bool weak) {
+    size_t len = strlen(etag);
+    const char *p = list;
+    while (1) {
+        while (*p == ' ' || *p == ',') {
+            p++;
+        }
+        if (*p == '\0') {
+            return false;
+        } else if (*p == '*') {
+            return weak;
+        }
+        bool is_weak = strncmp(p, "W/", 2) == 0;
+        if (is_weak) {
+            p += 2;
+        }
+        const char *end = *p == '"' ? strchr(p + 1, '"') : NULL;
+        if (end == NULL) {
+            return false; // malformed
+        }
+        end++;
+        if ((weak || !is_weak) && (size_t) (end - p) == len && strncmp(p, etag, len) == 0) {
+            return true;
+        }
+        p = end;
+    }
+}
+
+bool conn_not_modified(conn_t *conn) {
+    if (!conn->validated) {
+        return false;
+    }
+    if (conn->if_none_match != NULL) {
+        return etag_matches(conn->if_none_match, conn->etag, true);
+    }
+    if (conn->if_modified_since != NULL) {
+        time_t since = parse_date(conn->if_modified_since);
+        return since >= 0 && conn->mtime <= since;
+    }
+    return false;
+}
+
+// Return whether If-Range names the version of the file that the
+// validators describe: its ETag (compared strongly) or its exact
+// Last-Modified time.
+static bool if_range_matches(conn_t *conn) {
+    if (!conn->validated) {
+        return false;
+    } else if (conn->if_range[0] == '"') {
+        return etag_matches(conn->if_range, conn->etag, false);
+    }
+    time_t date = parse_date(conn->if_range);
+    return date >= 0 && date == conn->mtime;
+}
+
+// Parse the decimal number at *p, if there is one, and move past it.
+static bool parse_pos(const char **p, uint64_t *n) {
+    if (!isdigit((unsigned char) **p)) {
+        return false;
+    }
+    char *end;
+    *n = strtoull(*p, &end, 10); // saturates on overflow
+    *p = end;
+    return true;
+}
+
+int conn_get_ranges(conn_t *conn, uint64_t size, ByteRange *ranges, int max) {
+    const char *p = conn->range;
+    if (p == NULL || strncasecmp(p, "bytes=", 6) != 0) {
+        return 0;
+    }
+    // the client holds another version: it gets the whole file
+    if (conn->if_range != NULL && !if_range_matches(conn)) {
+        return 0;
+    }
+    p += 6;
+
+    int n = 0;
+    while (1) {
+        while (*p == ' ') {
+            p++;
+        }
+        uint64_t first, last;
+        if (*p == '-') {
+            // the last n bytes
+            p++;
+            uint64_t suffix;
+            if (!parse_pos(&p, &suffix)) {
+                return 0;
+            }
+            first = suffix < size ? size - suffix : 0;
+            last = suffix > 0 ? size - 1 : 0;
+            if (suffix == 0 || size == 0) {
+                first = size; // unsatisfiable
+            }
+        } else {
+            if (!parse_pos(&p, &first) || *p++ != '-') {
+                return 0;
+            }
+            if (!parse_pos(&p, &last)) {
+                last = UINT64_MAX; // to the end
+            } else if (last < first) {
+                return 0;
+            }
+            if (last >= size) {
+                last = size - 1;
+            }
+        }
+
+        // a range that starts past the end is skipped
+        if (first < size) {
+            if (n == max) {
+                return 0;
+            }
+            ranges[n].offset = first;
+            ranges[n].count = last - first + 1;
+            n++;
+        }
+
+        while (*p == ' ') {
+            p++;
+        }
+        if (*p == '\0') {
+            break;
+        } else if (*p++ != ',') {
+            return 0;
+        }
+    }
+    return n > 0 ? n : -1;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Functions that help get data from a connection
+
+// the longest chunk size that we accept, in hex digits
+#define MAX_CHUNK_DIGITS 15
+
+// Read a chunk's size line ("1a2b\r\n", possibly with ";extensions").
+// Returns false if the line is malformed or can't be read.
+static bool read_chunk_size(conn_t *conn, uint64_t *size) {
+    char *line;
+    uint16_t len;
+    if (bs_read_until(conn->bs, &line, &len, "\r\n") != BR_OK) {
+        return false;
+    }
+    size_t digits = strspn(line, "0123456789abcdefABCDEF");
+    char after = line[digits];
+    bool ok = digits > 0 && digits <= MAX_CHUNK_DIGITS
+              && (after == '\r' || after == ';' || after == ' ' || after == '\t');
+    *size = strtoull(line, NULL, 16);
+    return ok;
+}
+
+// Read the CRLF that ends a chunk, or the empty line that ends the
+// trailer section (ignoring any trailer fields before it).
+static bool read_crlf(conn_t *conn, bool trailers) {
+    char *line;
+    uint16_t len;
+    do {
+        if (bs_read_until(conn->bs, &line, &len, "\r\n") != BR_OK) {
+            return false;
+        }
+    } while (trailers && len > 2);
+    return len == 2;
+}
+
+// write a chunked body from the connection into the file (fd): each
+// chunk's data goes to the file as in the Content-Length case (spliced,
+// once the buffered bytes are used up), and only the size lines are
+// read into the buffer
+static const Response_t *recv_chunked(conn_t *conn, int fd) {
+    uint64_t size;
+    while (1) {
+        if (!read_chunk_size(conn, &size)) {
+            conn->failed = true;
+            return &RESPONSE_BAD_REQUEST;
+        }
+        if (size == 0) {
+            break;
+        }
+        BufferedResult br = bs_recvfile(conn->bs, fd, size);
+        if (br != BR_OK) {
+            conn->failed = true;
+            return br == BR_CLOSED ? &RESPONSE_BAD_REQUEST : &RESPONSE_INTERNAL_SERVER_ERROR;
+        }
+        if (!read_crlf(conn, false)) {
+            conn->failed = true;
+            return &RESPONSE_BAD_REQUEST;
+        }
+    }
+    if (!read_crlf(conn, true)) {
+        conn->failed = true;
+        return &RESPONSE_BAD_REQUEST;
+    }
+    conn->body_read = true;
+    return NULL;
+}
+
+// write the data from the connection into the file (fd).
+const Response_t *conn_recv_file(conn_t *conn, int fd) {
+
+    const Response_t *res = NULL;
+    if (conn->te != NULL) {
+        return recv_chunked(conn, fd);
+    }
+    uint64_t cl = strtoull(conn_get_header(conn, "Content-Length"), NULL, 10);
+
+    debug("content length: %lu (%s)", cl, conn_get_header(conn, "Content-Length"));
+    BufferedResult br = bs_recvfile(conn->bs, fd, cl);
+
+    if (br != BR_OK) {
+        // a body cut short is the client's fault
+        res = br == BR_CLOSED ? &RESPONSE_BAD_REQUEST : &RESPONSE_INTERNAL_SERVER_ERROR;
+        conn->failed = true;
+    } else {
+        conn->body_read = true;
+    }
+    return res;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Functions that help write responses to the client:
+
+// the count of a body that is sent in chunks, or of a response that
+// has no body (and says nothing about its length)
+#define CHUNKED UINT64_MAX
+#define NO_BODY (UINT64_MAX - 1)
+
+// Format the headers of a response whose body is a file (or a 304 for
+// one). Returns their length.
+static int file_headers(conn_t *conn, char *buf) {
+    int n = sprintf(buf, "Accept-Ranges: bytes\r\n");
+    if (conn->validated) {
+        char date[64];
+        format_date(date, sizeof(date), conn->mtime);
+        n += sprintf(buf + n, "ETag: %s\r\nLast-Modified: %s\r\n", conn->etag, date);
+    }
+    return n;
+}
+
+// Format the status line and headers for a response with a count
+// byte body (or a chunked one), adding the headers in extra. Returns
+// the header length.
+static int format_head(
+    conn_t *conn, char *buf, const Response_t *res, uint64_t count, const char *extra) {
+    int n = sprintf(buf, "%s %d %s\r\n", HTTP_VERSION, response_get_code(res),
+        response_get_message(res));
+    if (count == CHUNKED) {
+        n += sprintf(buf + n, "Transfer-Encoding: chunked\r\n");
+    } else if (count != NO_BODY) {
+        n += sprintf(buf + n, "Content-Length: %lu\r\n", count);
+    }
+    return n + sprintf(buf + n, "%s%s\r\n", extra, conn->last ? "Connection: close\r\n" : "");
+}
+
+// send a message body from the file (fd)
+const Response_t *conn_send_file(conn_t *conn, int fd, uint64_t count) {
+    char buf[MAX_HEADER_LEN + 1];
+
+    char extra[MAX_HEADER_LEN / 2];
+    file_headers(conn, extra);
+
+    BufferedResult res = BR_OK;
+    int n = format_head(conn, buf, &RESPONSE_OK, count, extra);
+
+    // with no body to follow, a corked header would sit until the
+    // kernel's cork timer ran out
+    res = count > 0 ? bs_sendbuf_more(conn->bs, buf, n) : bs_sendbuf(conn->bs, buf, n);
+    if (res == BR_OK && count > 0)
+        res = bs_sendfile(conn->bs, fd, 0, count);
+    if (res != BR_OK)
+        conn->failed = true;
+
+    return NULL;
+}
+
+// send 304 for the file that the validators describe
+const Response_t *conn_send_not_modified(conn_t *conn) {
+    char buf[MAX_HEADER_LEN + 1];
+    char extra[MAX_HEADER_LEN / 2];
+    file_headers(conn, extra);
+
+    int n = format_head(conn, buf, &RESPONSE_NOT_MODIFIED, NO_BODY, extra);
+    if (bs_sendbuf(conn->bs, buf, n) != BR_OK)
+        conn->failed = true;
+    return NULL;
+}
+
+// the most that one read of a streamed body takes (and so one chunk)
+#define STREAM_CHUNK (64 * 1024)
+
+// send a message body of unknown size from the file (fd)
+const Response_t *conn_send_stream(conn_t *conn, int fd) {
+    char head[MAX_HEADER_LEN + 1];
+    if (stream_buf == NULL) {
+        stream_buf = malloc(STREAM_CHUNK);
+        if (stream_buf == NULL) {
+            conn->failed = true;
+            return &RESPONSE_INTERNAL_SERVER_ERROR;
+        }
+        register_thread();
+    }
+    char *data = stream_buf;
+
+    // the header goes out at once: the first read may wait a while
+    int n = format_head(conn, head, &RESPONSE_OK, CHUNKED, "");
+    BufferedResult res = bs_sendbuf(conn->bs, head, n);
+    while (res == BR_OK) {
+        ssize_t got = read(fd, data, STREAM_CHUNK);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0) {
+            // too late for an error response: the missing last chunk
+            // tells the client that the body is incomplete
+            res = BR_ERROR;
+            break;
+        }
+        char size[24];
+        struct iovec iov[3] = {
+            { size, sprintf(size, "%lx\r\n", (unsigned long) got) },
+            { data, got },
+            { "\r\n", 2 },
+        };
+        if (got == 0) {
+            // the last chunk, with no trailer fields
+            res = bs_sendbuf(conn->bs, "0\r\n\r\n", 5);
+            break;
+        }
+        res = bs_sendvec(conn->bs, iov, 3);
+    }
+
+    if (res != BR_OK)
+        conn->failed = true;
+    return NULL;
+}
+
+// the most that one part's header in a multipart/byteranges body takes
+#define PART_HEAD_LEN 128
+
+// send ranges of the file (fd)
+const Response_t *conn_send_ranges(
+    conn_t *conn, int fd, uint64_t size, const ByteRange *ranges, int n) {
+    char buf[MAX_HEADER_LEN + 1];
+    char extra[MAX_HEADER_LEN / 2];
+    BufferedResult res = BR_OK;
+
+    if (n < 0) {
+        const Response_t *r = &RESPONSE_RANGE_NOT_SATISFIABLE;
+        sprintf(extra, "Content-Range: bytes */%lu\r\n", size);
+        int len = format_head(conn, buf, r, strlen(response_get_message(r)) + 1, extra);
+        len += sprintf(buf + len, "%s\n", response_get_message(r));
+        res = bs_sendbuf(conn->bs, buf, len);
+    } else if (n == 1) {
+        int e = file_headers(conn, extra);
+        sprintf(extra + e, "Content-Range: bytes %lu-%lu/%lu\r\n", ranges[0].offset,
+            ranges[0].offset + ranges[0].count - 1, size);
+        int len = format_head(conn, buf, &RESPONSE_PARTIAL_CONTENT, ranges[0].count, extra);
+        res = bs_sendbuf_more(conn->bs, buf, len);
+        if (res == BR_OK)
+            res = bs_sendfile(conn->bs, fd, ranges[0].offset, ranges[0].count);
+    } else {
+        // every part is preceded by its own header, so the body's length
+        // is known before anything is sent
+        char parts[MAX_RANGES * PART_HEAD_LEN];
+        int part_len[MAX_RANGES];
+        assert(n <= MAX_RANGES);
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        char boundary[17];
+        sprintf(boundary, "%08lx%08lx", (unsigned long) now.tv_nsec & 0xffffffff,
+            (unsigned long) (uintptr_t) conn & 0xffffffff);
+
+        uint64_t total = 0;
+        for (int i = 0; i < n; i++) {
+            part_len[i] = sprintf(parts + i * PART_HEAD_LEN,
+                "\r\n--%s\r\nContent-Range: bytes %lu-%lu/%lu\r\n\r\n", boundary,
+                ranges[i].offset, ranges[i].offset + ranges[i].count - 1, size);
+            total += part_len[i] + ranges[i].count;
+        }
+        char tail[32];
+        int tail_len = sprintf(tail, "\r\n--%s--\r\n", boundary);
+        total += tail_len;
+
+        int e = file_headers(conn, extra);
+        sprintf(extra + e, "Content-Type: multipart/byteranges; boundary=%s\r\n", boundary);
+        int len = format_head(conn, buf, &RESPONSE_PARTIAL_CONTENT, total, extra);
+        res = bs_sendbuf_more(conn->bs, buf, len);
+        for (int i = 0; i < n && res == BR_OK; i++) {
+            res = bs_sendbuf_more(conn->bs, parts + i * PART_HEAD_LEN, part_len[i]);
+            if (res == BR_OK)
+                res = bs_sendfile(conn->bs, fd, ranges[i].offset, ranges[i].count);
+        }
+        if (res == BR_OK)
+            res = bs_sendbuf(conn->bs, tail, tail_len);
+    }
+
+    if (res != BR_OK)
+        conn->failed = true;
+    return NULL;
+}
+
+// send a message body from the file (fd) with io_uring
+const Response_t *conn_send_file_uring(conn_t *conn, uring_t *ring, int fd, uint64_t count) {
+    char *buf = uring_buffer(ring, MAX_HEADER_LEN + count);
+    if (buf == NULL) {
+        conn->failed = true;
+        return &RESPONSE_INTERNAL_SERVER_ERROR;
+    }
+
+    char extra[MAX_HEADER_LEN / 2];
+    file_headers(conn, extra);
+    int n = format_head(conn, buf, &RESPONSE_OK, count, extra);
+    if (uring_send_file(ring, conn_get_fd(conn), buf, n, fd, count) < 0)
+        conn->failed = true;
+
+    return NULL;
+}
+
+// send a message body from memory, in one writev with the header
+const Response_t *conn_send_buf(conn_t *conn, const void *buf, uint64_t count) {
+    char head[MAX_HEADER_LEN + 1];
+    char extra[MAX_HEADER_LEN / 2];
+    file_headers(conn, extra);
+
+    int n = format_head(conn, head, &RESPONSE_OK, count, extra);
+
+    struct iovec iov[2] = { { head, n }, { (void *) buf, count } };
+    if (bs_sendvec(conn->bs, iov, 2) != BR_OK)
+        conn->failed = true;
+    return NULL;
+}
+
+// send canonical message for a response type
+const Response_t *conn_send_response(conn_t *conn, const Response_t *res) {
+
+    char buf[MAX_HEADER_LEN + 1];
+
+    int n = format_head(conn, buf, res, strlen(response_get_message(res)) + 1, "");
+    n += sprintf(buf + n, "%s\n", response_get_message(res));
+
+    if (bs_sendbuf(conn->bs, buf, n) != BR_OK)
+        conn->failed = true;
+    return NULL;
+}
+
+const Response_t *conn_send_unavailable(conn_t *conn, int retry_after) {
+    const Response_t *res = &RESPONSE_SERVICE_UNAVAILABLE;
+    char buf[MAX_HEADER_LEN + 1];
+    char extra[32];
+    sprintf(extra, "Retry-After: %d\r\n", retry_after);
+
+    int n = format_head(conn, buf, res, strlen(response_get_message(res)) + 1, extra);
+    n += sprintf(buf + n, "%s\n", response_get_message(res));
+
+    if (bs_sendbuf(conn->bs, buf, n) != BR_OK)
+        conn->failed = true;
+    return NULL;
+}
+
+//Functions for debugging:
+
+#ifdef DEBUG
+char *conn_str(conn_t *conn) {
+    char buf[8192] = { 0 };
+    sprintf(buf + strlen(buf), "Conn {\n");
+    sprintf(buf + strlen(buf), "   type: %s,\n", request_get_str(conn->type));
+    sprintf(buf + strlen(buf), "    uri: %s,\n", conn->URI);
+    sprintf(buf + strlen(buf), "   heads: [\n");
+
+#define X(str, longstr, name) sprintf(buf + strlen(buf), "       " str ": %s\n", conn->name);
+    SAVE_HEADERS
+#undef X
+    sprintf(buf + strlen(buf), "          ]\n");
+    sprintf(buf + strlen(buf), "}");
+    return strdup(buf);
+}
+#endif
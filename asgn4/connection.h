@@ -2,19 +2,42 @@
 
 #include "response.h"
 #include "request.h"
+#include "uring.h"
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 typedef struct Conn conn_t;
 
+// count bytes of a file, starting at offset
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+} ByteRange;
+
+// the most byte ranges that one GET may ask for; a Range header with
+// more is ignored (and the whole file sent)
+#define MAX_RANGES 16
+
+typedef enum {
+    PARSE_AGAIN, // the request hasn't fully arrived yet
+    PARSE_DONE, // the request was parsed (successfully or not)
+    PARSE_CLOSED, // the client hung up without starting a request
+} ParseStatus;
+
 // Constructor
 conn_t *conn_new(int connfd);
 
 // Destructor
 void conn_delete(conn_t **conn);
 
+// Forget the current request so that the next one on the same socket
+// can be parsed. Bytes of the next request that were already read
+// (pipelining) are kept.
+void conn_reset(conn_t *conn);
+
 // Parse the data from connection. Checks static correctness (i.e.,
 // that each field fits within our required bounds), but does not
 // check for semantic correctness (e.g., does not check that a URI is
@@ -24,6 +47,16 @@ void conn_delete(conn_t **conn);
 // response that should be sent to the client.
 const Response_t *conn_parse(conn_t *conn);
 
+// Non-blocking version of conn_parse for connections driven by an
+// event loop. Reads whatever the client has sent so far and, once the
+// full header block has arrived, parses it.
+//
+// Returns PARSE_AGAIN if more data is needed, and PARSE_CLOSED if the
+// client hung up before sending any of a request. Otherwise returns
+// PARSE_DONE and sets *res to NULL if there's no error, or to a
+// response that should be sent to the client.
+ParseStatus conn_try_parse(conn_t *conn, const Response_t **res);
+
 //////////////////////////////////////////////////////////////////////
 // Functions that get stuff we might need elsewhere from a connection
 
@@ -37,10 +70,57 @@ char *conn_get_uri(conn_t *conn);
 // implemented for header named "Content-Length" and "Request-Id".
 char *conn_get_header(conn_t *conn, char *header);
 
+// Return the socket of the connection.
+int conn_get_fd(conn_t *conn);
+
+// Return the number of requests that were completed (reset) on this
+// connection before the current one.
+uint32_t conn_get_count(conn_t *conn);
+
+// Return whether the client asked to close the connection after this
+// request (Connection: close).
+bool conn_wants_close(conn_t *conn);
+
+// Return whether another request can be read from the connection:
+// nothing failed while sending or receiving, and the request's body
+// (if any) was consumed.
+bool conn_reusable(conn_t *conn);
+
+// Return whether none of the next request has been read yet.
+bool conn_idle(conn_t *conn);
+
+// Mark this request as the last one on the connection; responses then
+// carry "Connection: close".
+void conn_set_last(conn_t *conn);
+
+// Set the validators of the file that the response is about: an ETag
+// derived from its inode, size and modification time, and its
+// Last-Modified time. Responses with a file body (and 304s) then carry
+// them, until the connection is reset.
+void conn_set_validators(conn_t *conn, const struct stat *st);
+
+// Return whether the file is unchanged for the client, so 304 should be
+// sent instead of it: If-None-Match lists the file's ETag (or is "*"),
+// or, if there is no If-None-Match, the file was not modified since
+// If-Modified-Since. False if no validators were set.
+bool conn_not_modified(conn_t *conn);
+
+// Resolve the request's Range header against a file of size bytes into
+// at most max ranges, in the order they were asked for.
+//
+// Returns the number of ranges; 0 if the whole file should be sent
+// (there is no Range header, or it is malformed, not in bytes, or asks
+// for more than max ranges, all of which are ignored, or If-Range names
+// another version of the file than the validators that were set); or
+// -1 if none of the ranges overlaps the file.
+int conn_get_ranges(conn_t *conn, uint64_t size, ByteRange *ranges, int max);
+
 //////////////////////////////////////////////////////////////////////
 // Functions that help get data from a connection
 
-// write the data form the connection into the file (fd).
+// write the data form the connection into the file (fd): Content-Length
+// bytes of it, or a chunked body (Transfer-Encoding: chunked) up to its
+// last chunk.
 //
 // returns NULL if there's no error, otherwise returns a pointer to a
 // response that should be sent to the client.
@@ -55,11 +135,57 @@ const Response_t *conn_recv_file(conn_t *conn, int fd);
 // response that should be sent to the client.
 const Response_t *conn_send_file(conn_t *conn, int fd, uint64_t count);
 
+// send 304 Not Modified, with the validators and no body
+//
+// returns NULL if there's no error, otherwise returns a pointer to a
+// response that should be sent to the client.
+const Response_t *conn_send_not_modified(conn_t *conn);
+
+// send a message body from the file (fd) whose size is not known in
+// advance (e.g., a pipe), with chunked transfer encoding: whatever each
+// read returns is sent right away as one chunk, until end-of-file. fd
+// is read from its file offset.
+//
+// returns NULL if there's no error, otherwise returns a pointer to a
+// response that should be sent to the client.
+const Response_t *conn_send_stream(conn_t *conn, int fd);
+
+// send the n ranges (from conn_get_ranges, so at most MAX_RANGES) of
+// the file fd, which is size bytes long: a 206 response with the range as its body, or with
+// a multipart/byteranges body if there are several. If n is -1, send
+// 416 instead.
+//
+// returns NULL if there's no error, otherwise returns a pointer to a
+// response that should be sent to the client.
+const Response_t *conn_send_ranges(
+    conn_t *conn, int fd, uint64_t size, const ByteRange *ranges, int n);
+
+// send a message body from the file (fd) with the io_uring engine: the
+// file is read and sent with the header in one submission. fd is
+// left open (and its offset untouched).
+//
+// returns NULL if there's no error, otherwise returns a pointer to a
+// response that should be sent to the client.
+const Response_t *conn_send_file_uring(conn_t *conn, uring_t *ring, int fd, uint64_t count);
+
+// send a 200 response whose message body is the count bytes in buf
+//
+// returns NULL if there's no error, otherwise returns a pointer to a
+// response that should be sent to the client.
+const Response_t *conn_send_buf(conn_t *conn, const void *buf, uint64_t count);
+
 // send canonical message for a response type
 //
 // returns NULL if there's no error, otherwise returns a pointer to a
 // response that should be sent to the client.
 const Response_t *conn_send_response(conn_t *conn, const Response_t *res);
 
+// send 503 Service Unavailable, asking the client to retry after the
+// given number of seconds
+//
+// returns NULL if there's no error, otherwise returns a pointer to a
+// response that should be sent to the client.
+const Response_t *conn_send_unavailable(conn_t *conn, int retry_after);
+
 //Functions for debugging:
 char *conn_str(conn_t *conn);
@@ -0,0 +1,379 @@
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "fdcache.h"
+
+#define INITIAL_BUCKETS 64
+
+// generation counters; a URI's is picked by its hash, so a change to
+// one file rarely stops another from being cached
+#define GENERATIONS 256
+
+// the changes that can make a cached descriptor or stat stale
+#define WATCH_MASK                                                                                 \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MODIFY | IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef struct fdcache_entry {
+    char *key;
+    int fd; // -1: the file does not exist
+    struct stat st;
+    _Atomic int refs; // one for the cache, plus one per reference handed out
+    struct fdcache_entry *hnext; // next in the hash bucket
+    struct fdcache_entry *prev; // LRU order (least recently used first)
+    struct fdcache_entry *next;
+} fdcache_entry;
+
+typedef struct fdcache {
+    size_t capacity; // maximum entries
+
+    fdcache_entry **buckets;
+    size_t nbuckets; // always a power of two
+    size_t count; // number of entries
+    fdcache_entry *head;
+    fdcache_entry *tail;
+
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t mutex;
+
+    _Atomic uint64_t generations[GENERATIONS];
+
+    int inotify_fd;
+    int evfd; // wakes the watcher to stop it
+    _Atomic bool stop;
+    pthread_t watcher;
+} fdcache;
+
+// FNV-1a
+static size_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *) key; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    return (size_t) h;
+}
+
+static void *watcher_thread(void *arg);
+
+fdcache_t *fdcache_new(size_t capacity) {
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd < 0) {
+        return NULL;
+    }
+    if (inotify_add_watch(ifd, ".", WATCH_MASK) < 0) {
+        close(ifd);
+        return NULL;
+    }
+
+    fdcache_t *c = malloc(sizeof(fdcache));
+    if (c == NULL) {
+        fprintf(stderr, "failed to create new fd cache in fdcache_new()\n");
+        exit(1);
+    }
+    c->buckets = calloc(INITIAL_BUCKETS, sizeof(fdcache_entry *));
+    if (c->buckets == NULL) {
+        fprintf(stderr, "failed to allocate buckets in fdcache_new()\n");
+        exit(1);
+    }
+    int rc = pthread_mutex_init(&c->mutex, NULL);
+    assert(!rc);
+    (void) rc;
+
+    c->capacity = capacity;
+    c->nbuckets = INITIAL_BUCKETS;
+    c->count = 0;
+    c->head = NULL;
+    c->tail = NULL;
+    c->hits = 0;
+    c->misses = 0;
+    for (int i = 0; i < GENERATIONS; i++) {
+        atomic_init(&c->generations[i], 0);
+    }
+
+    c->inotify_fd = ifd;
+    atomic_init(&c->stop, false);
+    c->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (c->evfd < 0) {
+        fprintf(stderr, "failed to create eventfd in fdcache_new()\n");
+        exit(1);
+    }
+    if (pthread_create(&c->watcher, NULL, watcher_thread, c) != 0) {
+        fprintf(stderr, "failed to start watcher thread in fdcache_new()\n");
+        exit(1);
+    }
+    return c;
+}
+
+static void entry_unref(fdcache_entry *e) {
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        if (e->fd >= 0) {
+            close(e->fd);
+        }
+        free(e->key);
+        free(e);
+    }
+}
+
+void fdcache_delete(fdcache_t **c) {
+    if (c != NULL && *c != NULL) {
+        uint64_t one = 1;
+        atomic_store(&(*c)->stop, true);
+        ssize_t n = write((*c)->evfd, &one, sizeof(one));
+        (void) n;
+        pthread_join((*c)->watcher, NULL);
+        close((*c)->evfd);
+        close((*c)->inotify_fd);
+
+        fdcache_entry *e = (*c)->head;
+        while (e != NULL) {
+            fdcache_entry *next = e->next;
+            entry_unref(e);
+            e = next;
+        }
+        pthread_mutex_destroy(&(*c)->mutex);
+        free((*c)->buckets);
+        free(*c);
+        *c = NULL;
+    }
+}
+
+// All of the helpers below are called with c->mutex held.
+
+static fdcache_entry **find(fdcache_t *c, const char *key) {
+    fdcache_entry **pe = &c->buckets[hash(key) & (c->nbuckets - 1)];
+    while (*pe != NULL && strcmp((*pe)->key, key) != 0) {
+        pe = &(*pe)->hnext;
+    }
+    return pe;
+}
+
+static void grow(fdcache_t *c) {
+    size_t n = c->nbuckets * 2;
+    fdcache_entry **buckets = calloc(n, sizeof(fdcache_entry *));
+    if (buckets == NULL) {
+        return; // keep the longer chains
+    }
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        fdcache_entry *e = c->buckets[i];
+        while (e != NULL) {
+            fdcache_entry *hnext = e->hnext;
+            size_t b = hash(e->key) & (n - 1);
+            e->hnext = buckets[b];
+            buckets[b] = e;
+            e = hnext;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = n;
+}
+
+static void list_unlink(fdcache_t *c, fdcache_entry *e) {
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        c->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        c->tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void list_append(fdcache_t *c, fdcache_entry *e) {
+    e->next = NULL;
+    e->prev = c->tail;
+    if (c->tail) {
+        c->tail->next = e;
+    } else {
+        c->head = e;
+    }
+    c->tail = e;
+}
+
+// Remove the entry at *pe from the cache and drop the cache's reference.
+static void remove_entry(fdcache_t *c, fdcache_entry **pe) {
+    fdcache_entry *e = *pe;
+    *pe = e->hnext;
+    list_unlink(c, e);
+    c->count--;
+    entry_unref(e);
+}
+
+fdcache_entry_t *fdcache_get(fdcache_t *c, const char *uri) {
+    pthread_mutex_lock(&c->mutex);
+    fdcache_entry *e = *find(c, uri);
+    if (e != NULL) {
+        c->hits++;
+        list_unlink(c, e);
+        list_append(c, e);
+        atomic_fetch_add(&e->refs, 1);
+    } else {
+        c->misses++;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return e;
+}
+
+fdcache_entry_t *fdcache_peek(fdcache_t *c, const char *uri) {
+    pthread_mutex_lock(&c->mutex);
+    fdcache_entry *e = *find(c, uri);
+    if (e != NULL) {
+        atomic_fetch_add(&e->refs, 1);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return e;
+}
+
+uint64_t fdcache_generation(fdcache_t *c, const char *uri) {
+    return atomic_load(&c->generations[hash(uri) % GENERATIONS]);
+}
+
+fdcache_entry_t *fdcache_put(
+    fdcache_t *c, const char *uri, int fd, const struct stat *st, uint64_t generation) {
+    if (c->capacity == 0) {
+        return NULL;
+    }
+    fdcache_entry *e = malloc(sizeof(fdcache_entry));
+    if (e == NULL) {
+        return NULL;
+    }
+    e->key = strdup(uri);
+    if (e->key == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->fd = fd;
+    if (fd >= 0) {
+        e->st = *st;
+    } else {
+        memset(&e->st, 0, sizeof(e->st));
+    }
+    atomic_init(&e->refs, 2); // the cache's and the caller's
+
+    pthread_mutex_lock(&c->mutex);
+    // the watcher bumps the generation under the mutex, so this can't
+    // miss an invalidation that it is about to make
+    if (fdcache_generation(c, uri) != generation) {
+        pthread_mutex_unlock(&c->mutex);
+        free(e->key);
+        free(e);
+        return NULL;
+    }
+    fdcache_entry **pe = find(c, uri);
+    if (*pe != NULL) {
+        remove_entry(c, pe);
+    }
+    if (c->count >= c->capacity) {
+        remove_entry(c, find(c, c->head->key));
+    }
+
+    if (c->count >= c->nbuckets) {
+        grow(c);
+    }
+    pe = &c->buckets[hash(uri) & (c->nbuckets - 1)];
+    e->hnext = *pe;
+    *pe = e;
+    list_append(c, e);
+    c->count++;
+    pthread_mutex_unlock(&c->mutex);
+    return e;
+}
+
+void fdcache_invalidate(fdcache_t *c, const char *uri) {
+    pthread_mutex_lock(&c->mutex);
+    fdcache_entry **pe = find(c, uri);
+    if (*pe != NULL) {
+        remove_entry(c, pe);
+    }
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void fdcache_stats(fdcache_t *c, uint64_t *hits, uint64_t *misses) {
+    pthread_mutex_lock(&c->mutex);
+    *hits = c->hits;
+    *misses = c->misses;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+int fdcache_entry_fd(const fdcache_entry_t *e) {
+    return e->fd;
+}
+
+const struct stat *fdcache_entry_stat(const fdcache_entry_t *e) {
+    return &e->st;
+}
+
+void fdcache_entry_release(fdcache_entry_t **e) {
+    if (e != NULL && *e != NULL) {
+        entry_unref(*e);
+        *e = NULL;
+    }
+}
+
+// Drop the entry of a file that changed, or every entry if the changes
+// can't be told apart (the kernel's event queue overflowed, or the
+// directory itself went away).
+static void changed(fdcache_t *c, const char *name) {
+    pthread_mutex_lock(&c->mutex);
+    if (name != NULL) {
+        atomic_fetch_add(&c->generations[hash(name) % GENERATIONS], 1);
+        fdcache_entry **pe = find(c, name);
+        if (*pe != NULL) {
+            remove_entry(c, pe);
+        }
+    } else {
+        for (int i = 0; i < GENERATIONS; i++) {
+            atomic_fetch_add(&c->generations[i], 1);
+        }
+        while (c->head != NULL) {
+            remove_entry(c, find(c, c->head->key));
+        }
+    }
+    pthread_mutex_unlock(&c->mutex);
+}
+
+static void *watcher_thread(void *arg) {
+    fdcache_t *c = arg;
+    struct pollfd pfds[2] = {
+        { .fd = c->inotify_fd, .events = POLLIN },
+        { .fd = c->evfd, .events = POLLIN },
+    };
+    // room for at least one event with the longest name
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (!atomic_load(&c->stop)) {
+        if (poll(pfds, 2, -1) < 0) {
+            continue;
+        }
+        ssize_t n;
+        while ((n = read(c->inotify_fd, buf, sizeof(buf))) > 0) {
+            for (char *p = buf; p < buf + n;) {
+                struct inotify_event *ev = (struct inotify_event *) p;
+                if (ev->mask & (IN_Q_OVERFLOW | IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    changed(c, NULL);
+                } else if (ev->len > 0 && ev->name[0] != '_') {
+                    // names that start with '_' are PUTs' temporary
+                    // files, which no URI can name
+                    changed(c, ev->name);
+                }
+                p += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+    }
+    return NULL;
+}
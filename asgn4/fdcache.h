@@ -0,0 +1,144 @@
+/**
+ * @File fdcache.h
+ *
+ * A bounded, thread-safe cache of open file descriptors and their stat
+ * metadata, keyed by URI.  A URI that does not exist can be cached too,
+ * so a 404 (or a PUT's existence check) needs no system call either.
+ * Entries are evicted in LRU order, and an inotify watch on the working
+ * directory drops the entry of any file that changes behind the
+ * server's back.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/** @struct fdcache_t
+ *
+ *  @brief This typedef renames the struct fdcache.
+ */
+typedef struct fdcache fdcache_t;
+
+/** @struct fdcache_entry_t
+ *
+ *  @brief A reference to a cached file.  Its descriptor stays open
+ *         until the reference is released, even if the entry is evicted
+ *         or invalidated in the meantime.
+ */
+typedef struct fdcache_entry fdcache_entry_t;
+
+/** @brief Dynamically allocates and initializes a new cache, and starts
+ *         the thread that watches the working directory.
+ *
+ *  @param capacity the maximum number of entries (and so of open file
+ *         descriptors) to hold.
+ *
+ *  @return a pointer to a new fdcache_t, or NULL if the directory can't
+ *          be watched (a cache that can't notice changes would serve
+ *          stale files).
+ */
+fdcache_t *fdcache_new(size_t capacity);
+
+/** @brief Stop the watcher thread, delete a cache and close its file
+ *         descriptors.  Entries that are still referenced are closed
+ *         when they are released.
+ *
+ *  @param c the cache to be deleted.  *c is set to NULL.
+ */
+void fdcache_delete(fdcache_t **c);
+
+/** @brief Look up a URI.
+ *
+ *  @param c the cache.
+ *
+ *  @param uri the file's name, relative to the working directory.
+ *
+ *  @return a reference to the entry, which the caller must release with
+ *          fdcache_entry_release, or NULL on a miss.
+ */
+fdcache_entry_t *fdcache_get(fdcache_t *c, const char *uri);
+
+/** @brief Look up a URI without counting a hit or a miss, or making the
+ *         entry recently used: for a caller that only wants to know
+ *         what the cache knows (e.g., to classify a request).
+ *
+ *  @param c the cache.
+ *
+ *  @param uri the file's name, relative to the working directory.
+ *
+ *  @return a reference to the entry, which the caller must release with
+ *          fdcache_entry_release, or NULL if there is none.
+ */
+fdcache_entry_t *fdcache_peek(fdcache_t *c, const char *uri);
+
+/** @brief The URI's generation, which changes whenever the watcher sees
+ *         the file change (or a file that shares its counter).  Read it
+ *         before opening a file that missed, and pass it to fdcache_put.
+ *
+ *  @param c the cache.
+ *
+ *  @param uri the file's name.
+ */
+uint64_t fdcache_generation(fdcache_t *c, const char *uri);
+
+/** @brief Insert (or replace) an entry, evicting the least recently
+ *         used one if the cache is full.
+ *
+ *  @param c the cache.
+ *
+ *  @param uri the file's name.
+ *
+ *  @param fd the open file, which the cache takes over on success, or -1
+ *         for a file that does not exist.
+ *
+ *  @param st the file's metadata (ignored if fd is -1).
+ *
+ *  @param generation the value of fdcache_generation from before the
+ *         file was opened.  If it changed since, the file may have been
+ *         opened before its change was seen, and nothing is inserted.
+ *
+ *  @return a reference to the new entry, which the caller must release
+ *          with fdcache_entry_release, or NULL if nothing was inserted
+ *          (in which case the caller still owns fd).
+ */
+fdcache_entry_t *fdcache_put(
+    fdcache_t *c, const char *uri, int fd, const struct stat *st, uint64_t generation);
+
+/** @brief Remove an entry (if it is cached).
+ *
+ *  @param c the cache.
+ *
+ *  @param uri the file's name.
+ */
+void fdcache_invalidate(fdcache_t *c, const char *uri);
+
+/** @brief Get the hit and miss counts.
+ *
+ *  @param c the cache.
+ *
+ *  @param hits set to the number of lookups that found an entry.
+ *
+ *  @param misses set to the number of lookups that did not.
+ */
+void fdcache_stats(fdcache_t *c, uint64_t *hits, uint64_t *misses);
+
+/** @brief The entry's open file descriptor, or -1 if the file does not
+ *         exist.  Share it only through calls that take an explicit
+ *         offset (pread, sendfile with an offset): its file offset is
+ *         shared by every thread.
+ */
+int fdcache_entry_fd(const fdcache_entry_t *e);
+
+/** @brief The file's metadata, as of when it was opened.
+ */
+const struct stat *fdcache_entry_stat(const fdcache_entry_t *e);
+
+/** @brief Release a reference returned by fdcache_get, fdcache_peek or
+ *         fdcache_put.
+ *
+ *  @param e the reference.  *e is set to NULL.
+ */
+void fdcache_entry_release(fdcache_entry_t **e);
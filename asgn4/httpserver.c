@@ -3,35 +3,195 @@
 //     Andrew Quinn
 //     Brian Zhao
 
+#include "affinity.h"
 #include "asgn2_helper_funcs.h"
+#include "auditlog.h"
+#include "cache.h"
+#include "classq.h"
 #include "connection.h"
 #include "debug.h"
+#include "fdcache.h"
+#include "locktable.h"
+#include "metrics.h"
+#include "poller.h"
 #include "response.h"
 #include "request.h"
 #include "queue.h"
+#include "sched.h"
+#include "uring.h"
 
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <pthread.h>
-#include <sys/file.h>
 #include <sys/stat.h>
 
-#define OPTIONS "t:"
+#define OPTIONS "t:wc:e:k:m:a:f:uo:rp:n:x:q:s:b:W:R:A:i"
+
+// seconds a client has to send its request line and headers
+#define HEADER_TIMEOUT 5
+
+// number of reader-writer locks that URIs are hashed onto
+#define LOCK_STRIPES 1024
+
+// capacity of each worker's deque in work-stealing mode
+#define DEQUE_SIZE 64
+
+// default capacity of the shared dispatch queue (-q)
+#define QUEUE_SIZE 64
+
+// adaptive pool (-x): how often the load is checked, how long queued
+// connections may go untaken by busy workers before more are started,
+// and how long a worker must have been spare before one retires
+#define POOL_TICK_MS   10
+#define POOL_GROW_MS   5
+#define POOL_RETIRE_MS 5000
+
+// load shedding (-s): the seconds that a rejected client is told to
+// wait before retrying, and the fraction of the queue that must have
+// drained before connections are queued (and waited for) again
+#define RETRY_AFTER    1
+#define SHED_RESUME    2
+
+// class dispatch (-b): how many requests of each class (small, large,
+// unknown) are taken relative to the others while several wait (-W),
+// and how many workers each class has to itself (-R)
+#define CLASS_WEIGHTS  { 8, 1, 2 }
+#define CLASS_RESERVED { 1, 0, 0 }
+
+// only files up to 1/CACHE_OBJECT_FRACTION of the cache are cached, so
+// one large file can't flush everything else
+#define CACHE_OBJECT_FRACTION 8
+
+// default number of requests served on one kept-alive connection
+#define MAX_REQUESTS 100
+
+// PUT bodies are received into a temporary file made from this
+// template. '_' can't appear in a URI, so it never shadows a file
+#define PUT_TEMPLATE "_put_XXXXXX"
+
+// io_uring engine (-u): submission queue entries per worker's ring,
+// and the largest file that is sent through it (larger files are sent
+// with sendfile, which never copies them)
+#define URING_ENTRIES  8
+#define URING_MAX_FILE (64 * 1024)
+
+// default milliseconds between flushes of the audit log
+#define AUDIT_INTERVAL 10
 
 queue_t *q = NULL;
-pthread_mutex_t mutex;
+// non-NULL in work-stealing mode (-w), in which case q is unused
+sched_t *sched = NULL;
+// non-NULL in class dispatch mode (-b), in which case q is unused: a
+// request is small or large by whether its file or body has more than
+// small_bytes
+classq_t *cq = NULL;
+uint64_t small_bytes = 0;
+locktable_t *locks = NULL;
+// non-NULL when GET responses are cached in memory (-c)
+cache_t *cache = NULL;
+size_t cache_max_object = 0;
+// seconds an idle connection is kept open (-k); 0 closes every
+// connection after one request
+int keep_alive = 0;
+uint32_t max_requests = MAX_REQUESTS;
+poller_t *poller = NULL;
+// -r: each worker accepts on its own SO_REUSEPORT listener, with its
+// own poller, and handles its connections itself
+int listen_port = 0;
+static __thread poller_t *own_poller = NULL;
+// -A cpus: threads are pinned to these CPUs, in order: the poller to
+// the first and the workers round-robin after it (with -r, the workers
+// from the first). -i: with -r, each worker's listener gets the
+// connections whose packets arrive on its CPU
+static int cpus[AFFINITY_MAX_CPUS];
+static int num_cpus = 0;
+bool steer = false;
+// non-NULL when metrics are served on an admin port (-p)
+metrics_t *metrics = NULL;
+_Atomic int num_workers = 0;
+auditlog_t *audit_log = NULL;
+// -u: GETs open, stat, read and send files through a per-worker io_uring
+bool use_uring = false;
+static __thread uring_t *ring = NULL;
+// non-NULL when open files and their metadata are cached (-o)
+fdcache_t *fdcache = NULL;
+// who we are, for may_replace() (as access(2) checks, by the real ids)
+static uid_t server_uid;
+static gid_t server_gid;
 
-void *handle_connection();
+// the worker pool (with a dispatch queue): pool_live workers are
+// running, and a worker that pops retire_tag exits if there are more
+// than pool_target of them
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static int pool_live = 0;
+static int pool_target = 0;
+static char retire_tag;
+// retire tags that did not fit in the queue yet; a worker that pops a
+// connection (and so makes room) offers them again
+static _Atomic int retire_owed = 0;
+// the pool adapts to the load between pool_min and pool_max workers
+// (-t and -x), once the thread that manages it has been started
+static int pool_min = 0;
+static int pool_max = 0;
+static bool pool_managed = false;
+static _Atomic int pool_idle = 0; // workers waiting for a connection
+static _Atomic uint64_t last_pop = 0; // when a worker last took one (ms)
+// -s ms: a connection that finds the shared queue full waits this long
+// for room, and is then answered with 503; until the queue has drained
+// to 1/SHED_RESUME of its capacity, connections that find it full are
+// answered with 503 at once (only the poller dispatches, so shedding
+// is its own)
+int shed_ms = 0;
+int queue_capacity = 0;
+static _Atomic bool shedding = false;
+// SIGHUP reads the new size of the pool from this file (-n)
+char *threads_file = NULL;
+// set by SIGTERM: the pollers stop accepting, and main() returns once
+// every accepted connection has been served
+static _Atomic bool draining = false;
+static poller_t **pollers = NULL;
+static int num_pollers = 0;
 
+void *handle_connection(void *);
+void *handle_reuseport(void *);
+void serve(conn_t *);
+void *handle_signals(void *);
+void drain(void);
+void reload(void);
+void register_poller(poller_t *);
+void pool_resize(int);
+void pool_bounds(int, int);
+void *manage_pool(void *);
+bool retire(void);
+void offer_retire_tags(void);
+void worker_popped(void);
+uint64_t now_ms(void);
+void write_gauges(metrics_t *, FILE *);
+int dispatch(conn_t **, const int *, int);
+bool push_or_shed(conn_t *, int);
+classq_class_t classify(conn_t *);
+bool parse_classes(const char *, int *);
+int queued_length(void);
+int serve_all(conn_t **, const int *, int);
+int pin_thread(int);
+bool next_request(conn_t *);
+
+char *read_file(int, uint64_t);
+void close_file(int, fdcache_entry_t **);
 void handle_get(conn_t *);
 void handle_put(conn_t *);
+bool may_replace(const char *, const struct stat *);
+bool put_target_moved(const char *, const fdcache_entry_t *, bool, const struct stat *);
 void handle_unsupported(conn_t *);
 
 void audit(conn_t *conn, const Response_t *res) {
@@ -42,7 +202,14 @@ void audit(conn_t *conn, const Response_t *res) {
     uint16_t code = response_get_code(res);
     char *id = conn_get_header(conn, "Request-Id");
 
-    fprintf(stderr, "%s,%s,%hu,%s\n", oper, URI, code, id);
+    // called with the URI's lock held: the log orders lines by when
+    // this is called, so they follow the order the locks were taken in
+    auditlog_write(audit_log, "%s,%s,%hu,%s\n", oper, URI, code, id);
+    metrics_response(metrics,
+        req == &REQUEST_GET   ? METHOD_GET
+        : req == &REQUEST_PUT ? METHOD_PUT
+                              : METHOD_OTHER,
+        code);
 }
 
 int main(int argc, char **argv) {
@@ -55,10 +222,74 @@ int main(int argc, char **argv) {
 
     // default number of worker thread is 4
     int num_thread = 4;
+    // -x threads: the pool may grow to this many workers under load;
+    // -q size: the capacity of the dispatch queue
+    int max_threads = 0;
+    int queue_size = QUEUE_SIZE;
+    // -w: per-worker deques with work stealing instead of one shared queue
+    bool stealing = false;
+    // -b bytes: a queue per class of request instead of one shared
+    // queue; -W and -R: the classes' weights and reserved workers
+    int weights[CLASS_COUNT] = CLASS_WEIGHTS;
+    int reserved[CLASS_COUNT] = CLASS_RESERVED;
+    // -c bytes: cache hot files in memory; -e: the eviction policy
+    size_t cache_size = 0;
+    cache_policy_t policy = CACHE_LRU;
+    // -a file: append the audit log to file instead of stderr;
+    // -f ms: how often the audit log is written out
+    char *audit_file = NULL;
+    int audit_interval = AUDIT_INTERVAL;
+    // -o entries: keep up to entries files open, with their metadata
+    size_t open_files = 0;
+    bool reuseport = false;
+    // -p port: serve metrics on this admin port
+    int metrics_port = 0;
     int opt;
     while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
         switch (opt) {
         case 't': num_thread = strtoul(optarg, NULL, 10); break;
+        case 'w': stealing = true; break;
+        case 'k': keep_alive = strtoul(optarg, NULL, 10); break;
+        case 'm': max_requests = strtoul(optarg, NULL, 10); break;
+        case 'u': use_uring = true; break;
+        case 'r': reuseport = true; break;
+        case 'p': metrics_port = strtoul(optarg, NULL, 10); break;
+        case 'n': threads_file = optarg; break;
+        case 'x': max_threads = strtoul(optarg, NULL, 10); break;
+        case 'q': queue_size = strtoul(optarg, NULL, 10); break;
+        case 's': shed_ms = strtoul(optarg, NULL, 10); break;
+        case 'b': small_bytes = strtoull(optarg, NULL, 10); break;
+        case 'A':
+            num_cpus = affinity_parse(optarg, cpus, AFFINITY_MAX_CPUS);
+            if (num_cpus < 0) {
+                fprintf(stderr, "cannot parse the CPU list %s (e.g., 0-3,8 or all)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'i': steer = true; break;
+        case 'W':
+        case 'R':
+            if (!parse_classes(optarg, opt == 'W' ? weights : reserved)) {
+                fprintf(stderr, "-%c needs three numbers, small:large:unknown\n", opt);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'a': audit_file = optarg; break;
+        case 'f': audit_interval = strtoul(optarg, NULL, 10); break;
+        case 'c': cache_size = strtoull(optarg, NULL, 10); break;
+        case 'o': open_files = strtoull(optarg, NULL, 10); break;
+        case 'e':
+            if (strcmp(optarg, "fifo") == 0) {
+                policy = CACHE_FIFO;
+            } else if (strcmp(optarg, "lru") == 0) {
+                policy = CACHE_LRU;
+            } else if (strcmp(optarg, "clock") == 0) {
+                policy = CACHE_CLOCK;
+            } else {
+                fprintf(stderr, "unknown eviction policy %s (fifo, lru or clock)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
         }
     }
 
@@ -69,81 +300,723 @@ int main(int argc, char **argv) {
 
     size_t port = (size_t) strtoull(argv[optind], NULL, 10);
 
-    // initializing sockets for port
+    // initializing sockets for port (with -r, the workers listen)
     signal(SIGPIPE, SIG_IGN);
     Listener_Socket sock;
-    listener_init(&sock, port);
+    if (!reuseport) {
+        listener_init(&sock, port);
+    }
 
     // intializing errno
     errno = 0;
 
-    // new queue
-    // size = num_thread
-    q = queue_new(num_thread);
+    // SIGINT, SIGTERM and SIGHUP are handled by one thread. Blocked
+    // here, before any other thread exists, so every thread inherits the
+    // mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    int audit_fd = STDERR_FILENO;
+    if (audit_file != NULL) {
+        audit_fd = open(audit_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (audit_fd < 0) {
+            fprintf(stderr, "cannot open audit log %s\n", audit_file);
+            return EXIT_FAILURE;
+        }
+    }
+    audit_log = auditlog_new(audit_fd, audit_interval);
+    pthread_t signal_thread;
+    pthread_create(&signal_thread, NULL, handle_signals, &signals);
+
+    if (steer && (!reuseport || num_cpus == 0)) {
+        fprintf(stderr, "-i needs -r and -A; not steering connections\n");
+        steer = false;
+    }
+    // the poller's thread is pinned before the shared structures are
+    // allocated, so they are on its NUMA node
+    if (!reuseport) {
+        pin_thread(0);
+    }
+
+    // new queue, whose capacity does not depend on the number of workers
+    if (reuseport) {
+        // no hand-off: every worker accepts its own connections
+    } else if (stealing) {
+        sched = sched_new(num_thread, DEQUE_SIZE);
+    } else if (small_bytes > 0) {
+        cq = classq_new(queue_size > 0 ? queue_size : 1, weights, reserved);
+    } else {
+        queue_capacity = queue_size > 0 ? queue_size : 1;
+        q = queue_new(queue_capacity);
+    }
+
+    if (use_uring) {
+        // fall back to the plain system calls if there is no io_uring
+        uring_t *probe = uring_new(URING_ENTRIES);
+        if (probe == NULL) {
+            fprintf(stderr, "io_uring is not available; using the default I/O path\n");
+            use_uring = false;
+        }
+        uring_delete(&probe);
+    }
+
+    num_workers = num_thread;
+    if (metrics_port > 0) {
+        metrics = metrics_new();
+        if (metrics_serve(metrics, metrics_port, write_gauges) < 0) {
+            fprintf(stderr, "cannot listen on metrics port %d\n", metrics_port);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // per-URI reader-writer locks; must exist before the workers start
+    locks = locktable_new(LOCK_STRIPES);
+    server_uid = getuid();
+    server_gid = getgid();
+
+    if (cache_size > 0) {
+        cache = cache_new(cache_size, policy);
+        cache_max_object = cache_size / CACHE_OBJECT_FRACTION;
+    }
+
+    if (open_files > 0) {
+        fdcache = fdcache_new(open_files);
+        if (fdcache == NULL) {
+            fprintf(stderr, "cannot watch the directory; not caching open files\n");
+        }
+    }
+
+    // one poller per worker with -r, else one for the listener
+    pollers = malloc(num_thread * sizeof(poller_t *));
+    if (pollers == NULL) {
+        fprintf(stderr, "failed to allocate pollers in main()\n");
+        return EXIT_FAILURE;
+    }
 
     // an array of threads with size = size of threads indicated
-    pthread_t threads[num_thread];
+    if (reuseport) {
+        pthread_t threads[num_thread];
+        listen_port = port;
+        for (int i = 0; i < num_thread; i++) {
+            pthread_create(&threads[i], NULL, handle_reuseport, (void *) (uintptr_t) i);
+        }
+        // each worker returns once its poller has drained
+        for (int i = 0; i < num_thread; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        auditlog_flush(audit_log);
+        return EXIT_SUCCESS;
+    }
     // initializing each worker thread
-    for (int i = 0; i < num_thread; i++) {
-        pthread_create(&threads[i], NULL, handle_connection, NULL);
+    if (max_threads > num_thread && sched != NULL) {
+        fprintf(stderr, "-x needs a shared queue; keeping %d workers\n", num_thread);
+    }
+    if (shed_ms > 0 && q == NULL) {
+        fprintf(stderr, "-s needs the shared queue; not shedding load\n");
     }
+    pool_bounds(num_thread, max_threads > num_thread && sched == NULL ? max_threads : num_thread);
 
-    // initializing mutex for flock
-    int rc = 0;
-    rc = pthread_mutex_init(&mutex, NULL);
-    assert(!rc);
+    // Listener: the poller accepts connections and waits (without
+    // tying up a worker) until their headers have arrived, then
+    // dispatches the parsed connection to the workers
+    poller = poller_new(&sock, dispatch, HEADER_TIMEOUT, keep_alive, metrics);
+    register_poller(poller);
+    poller_run(poller);
 
-    // Listener
-    while (1) {
-        uintptr_t connfd = listener_accept(&sock);
-        queue_push(q, (void *) connfd);
-        //close(connfd);
+    // Drained: every accepted connection was dispatched, and the
+    // workers finish them before they retire (a stolen retire_tag could
+    // overtake connections on a peer's deque, and a retire_tag, which
+    // is small, connections of other classes, so those are left to
+    // empty first); the worker that empties them wakes us
+    pthread_mutex_lock(&pool_mutex);
+    while (sched_length(sched) > 0 || classq_length(cq, CLASS_COUNT) > 0) {
+        pthread_cond_wait(&pool_cond, &pool_mutex);
     }
+    pthread_mutex_unlock(&pool_mutex);
+    pool_resize(0);
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_live > 0) {
+        pthread_cond_wait(&pool_cond, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    poller_delete(&poller);
 
+    auditlog_flush(audit_log);
     return EXIT_SUCCESS;
 }
 
-void *handle_connection() {
+// Waits for signals. SIGHUP resizes the worker pool, and the first
+// SIGTERM drains the server. SIGINT (or another SIGTERM) flushes the
+// audit log, and then lets the signal kill the server as it would have
+void *handle_signals(void *arg) {
+    sigset_t *signals = arg;
+    int sig;
+    while (1) {
+        sigwait(signals, &sig);
+        if (sig == SIGHUP) {
+            reload();
+        } else if (sig == SIGTERM && !atomic_load(&draining)) {
+            drain();
+        } else {
+            break;
+        }
+    }
+
+    auditlog_flush(audit_log);
+
+    signal(sig, SIG_DFL);
+    pthread_sigmask(SIG_UNBLOCK, signals, NULL);
+    raise(sig);
+    return NULL;
+}
+
+// SIGTERM: the pollers stop accepting and finish reading the requests
+// that have started arriving, and kept-alive connections are closed
+// after their current request
+void drain(void) {
+    pthread_mutex_lock(&pool_mutex);
+    atomic_store(&draining, true);
+    for (int i = 0; i < num_pollers; i++) {
+        poller_stop(pollers[i]);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// makes a poller known to drain(), which may already have been called
+void register_poller(poller_t *p) {
+    pthread_mutex_lock(&pool_mutex);
+    pollers[num_pollers++] = p;
+    if (atomic_load(&draining)) {
+        poller_stop(p);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// SIGHUP: resizes the worker pool to the number in the -n file, or
+// bounds it by the two numbers (minimum and maximum) in it
+void reload(void) {
+    if (threads_file == NULL) {
+        fprintf(stderr, "SIGHUP ignored: no file to read the number of workers from (-n)\n");
+        return;
+    }
+    if (sched != NULL) {
+        fprintf(stderr, "SIGHUP ignored: only a shared queue's pool can be resized\n");
+        return;
+    }
+    FILE *f = fopen(threads_file, "r");
+    int min = 0, max = 0;
+    int got = f != NULL ? fscanf(f, "%d %d", &min, &max) : 0;
+    if (got < 1 || min < 1 || (got == 2 && max < min)) {
+        fprintf(stderr, "cannot read the number of workers from %s\n", threads_file);
+    } else {
+        pool_bounds(min, got == 2 ? max : min);
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+}
+
+// Starts workers until there are n, or has as many as exceed n retire
+// once they have served what was dispatched before them. The pool only
+// shrinks once the server is draining
+void pool_resize(int n) {
+    pthread_mutex_lock(&pool_mutex);
+    if (atomic_load(&draining) && n > 0) {
+        pthread_mutex_unlock(&pool_mutex);
+        return;
+    }
+    pool_target = n;
+    while (pool_live < pool_target) {
+        pthread_t thread;
+        // the index is only used by the work-stealing scheduler, whose
+        // pool is never resized
+        if (pthread_create(&thread, NULL, handle_connection, (void *) (uintptr_t) pool_live) != 0) {
+            fprintf(stderr, "failed to create a worker in pool_resize()\n");
+            pool_target = pool_live;
+            break;
+        }
+        pthread_detach(thread);
+        pool_live++;
+    }
+    // surplus tags (from an earlier resize) are ignored by the workers
+    atomic_store(&retire_owed, pool_live - pool_target);
+    num_workers = pool_live;
+    classq_set_workers(cq, pool_live);
+    offer_retire_tags();
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Pushes the retire tags that are owed while the queue has room, and
+// leaves the rest for the next worker that pops a connection: neither
+// the signal thread nor the manager may wait on a full queue. Tags
+// bypass dispatch(), as a tag must never be shed. Called with
+// pool_mutex held
+void offer_retire_tags(void) {
+    while (atomic_load(&retire_owed) > 0) {
+        bool pushed;
+        if (sched != NULL) {
+            pushed = sched_try_push(sched, &retire_tag);
+        } else if (cq != NULL) {
+            pushed = classq_try_push(cq, &retire_tag, CLASS_SMALL);
+        } else {
+            pushed = queue_try_push(q, &retire_tag);
+        }
+        if (!pushed) {
+            break;
+        }
+        atomic_fetch_sub(&retire_owed, 1);
+    }
+}
+
+// called by a worker that popped from the queue: there is room for a
+// tag that is owed, and main() waits (while draining) for the queue
+// to empty
+void worker_popped(void) {
+    if (atomic_load(&retire_owed) == 0 && !atomic_load(&draining)) {
+        return;
+    }
+    pthread_mutex_lock(&pool_mutex);
+    offer_retire_tags();
+    if (queued_length() == 0) {
+        pthread_cond_broadcast(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+// Sets the pool's bounds and resizes it into them. A pool that may grow
+// gets a thread that manages its size
+void pool_bounds(int min, int max) {
+    pthread_mutex_lock(&pool_mutex);
+    pool_min = min;
+    pool_max = max;
+    int n = pool_target < min ? min : pool_target > max ? max : pool_target;
+    bool start = max > min && !pool_managed;
+    pool_managed |= start;
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (start) {
+        atomic_store(&last_pop, now_ms());
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, manage_pool, NULL) != 0) {
+            fprintf(stderr, "failed to create pool manager in pool_bounds()\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+    pool_resize(n);
+}
+
+// Adapts the pool to the load. Workers are added when connections queue
+// up while none is idle: when at least as many are queued as there are
+// workers, or when no worker has taken one for POOL_GROW_MS (so the
+// oldest has waited at least that long). One worker retires when some
+// worker has been idle at every check for POOL_RETIRE_MS
+void *manage_pool(void *arg) {
+    (void) arg;
+    uint64_t spare_since = 0;
+    while (!atomic_load(&draining)) {
+        usleep(POOL_TICK_MS * 1000);
+        int queued = queued_length();
+        int idle = atomic_load(&pool_idle);
+        uint64_t now = now_ms();
+
+        pthread_mutex_lock(&pool_mutex);
+        int target = pool_target, min = pool_min, max = pool_max;
+        pthread_mutex_unlock(&pool_mutex);
+
+        if (queued > 0 && idle == 0 && target < max
+            && (queued >= target || now - atomic_load(&last_pop) >= POOL_GROW_MS)) {
+            // one more worker per queued connection
+            pool_resize(target + queued < max ? target + queued : max);
+            spare_since = 0;
+        } else if (idle > 0 && target > min) {
+            if (spare_since == 0) {
+                spare_since = now;
+            } else if (now - spare_since >= POOL_RETIRE_MS) {
+                pool_resize(target - 1);
+                spare_since = now;
+            }
+        } else {
+            spare_since = 0;
+        }
+    }
+    return NULL;
+}
+
+// monotonic milliseconds
+uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// called by a worker that popped retire_tag: true if it should exit
+bool retire(void) {
+    pthread_mutex_lock(&pool_mutex);
+    bool exit = pool_live > pool_target;
+    if (exit) {
+        pool_live--;
+        num_workers = pool_live;
+        classq_set_workers(cq, pool_live);
+        pthread_cond_broadcast(&pool_cond);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return exit;
+}
+
+// appends the server's gauges to a metrics scrape
+void write_gauges(metrics_t *m, FILE *out) {
+    double uptime = metrics_uptime(m);
+    fprintf(out,
+        "# HELP httpserver_workers Worker threads.\n"
+        "# TYPE httpserver_workers gauge\n"
+        "httpserver_workers %d\n"
+        "# HELP httpserver_worker_utilization Fraction of the workers' time spent busy since start.\n"
+        "# TYPE httpserver_worker_utilization gauge\n"
+        "httpserver_worker_utilization %.4f\n"
+        "# HELP httpserver_queue_length Parsed requests waiting for a worker.\n"
+        "# TYPE httpserver_queue_length gauge\n"
+        "httpserver_queue_length %d\n"
+        "# HELP httpserver_shedding Whether connections that find the queue full are answered with 503.\n"
+        "# TYPE httpserver_shedding gauge\n"
+        "httpserver_shedding %d\n",
+        num_workers, uptime > 0 ? metrics_busy_seconds(m) / (uptime * num_workers) : 0.0,
+        queued_length(), atomic_load(&shedding));
+
+    if (cq != NULL) {
+        fprintf(out,
+            "# HELP httpserver_class_queue_length Parsed requests waiting for a worker, by class.\n"
+            "# TYPE httpserver_class_queue_length gauge\n"
+            "httpserver_class_queue_length{class=\"small\"} %d\n"
+            "httpserver_class_queue_length{class=\"large\"} %d\n"
+            "httpserver_class_queue_length{class=\"unknown\"} %d\n",
+            classq_length(cq, CLASS_SMALL), classq_length(cq, CLASS_LARGE),
+            classq_length(cq, CLASS_UNKNOWN));
+    }
+
+    uint64_t hits, misses;
+    if (cache != NULL) {
+        cache_stats(cache, &hits, &misses);
+        fprintf(out,
+            "# HELP httpserver_cache_lookups_total Content cache lookups, by result.\n"
+            "# TYPE httpserver_cache_lookups_total counter\n"
+            "httpserver_cache_lookups_total{result=\"hit\"} %lu\n"
+            "httpserver_cache_lookups_total{result=\"miss\"} %lu\n",
+            hits, misses);
+    }
+    if (fdcache != NULL) {
+        fdcache_stats(fdcache, &hits, &misses);
+        fprintf(out,
+            "# HELP httpserver_fdcache_lookups_total Open-file cache lookups, by result.\n"
+            "# TYPE httpserver_fdcache_lookups_total counter\n"
+            "httpserver_fdcache_lookups_total{result=\"hit\"} %lu\n"
+            "httpserver_fdcache_lookups_total{result=\"miss\"} %lu\n",
+            hits, misses);
+    }
+}
+
+// the number of parsed connections waiting for a worker
+int queued_length(void) {
+    if (sched != NULL) {
+        return sched_length(sched);
+    } else if (cq != NULL) {
+        return classq_length(cq, CLASS_COUNT);
+    }
+    return queue_length(q);
+}
+
+// parses "small:large:unknown" into one number per class
+bool parse_classes(const char *s, int *out) {
+    return sscanf(s, "%d:%d:%d", &out[CLASS_SMALL], &out[CLASS_LARGE], &out[CLASS_UNKNOWN]) == 3;
+}
+
+// the class of a parsed request, from what is known without touching
+// the disk (it runs on the poller's thread): a GET by the size of the
+// file if the -o cache has it (small if there's no file to send), a
+// PUT by its Content-Length. Chunked bodies, files that are not
+// regular (e.g., pipes) and files that are not cached have no size up
+// front
+classq_class_t classify(conn_t *conn) {
+    const Request_t *req = conn_get_request(conn);
+    if (req == &REQUEST_GET) {
+        fdcache_entry_t *fe = fdcache != NULL ? fdcache_peek(fdcache, conn_get_uri(conn)) : NULL;
+        if (fe == NULL) {
+            return CLASS_UNKNOWN;
+        }
+        const struct stat *st = fdcache_entry_stat(fe);
+        classq_class_t cls = CLASS_SMALL;
+        if (fdcache_entry_fd(fe) >= 0 && S_ISREG(st->st_mode)) {
+            cls = (uint64_t) st->st_size > small_bytes ? CLASS_LARGE : CLASS_SMALL;
+        } else if (fdcache_entry_fd(fe) >= 0 && !S_ISDIR(st->st_mode)) {
+            cls = CLASS_UNKNOWN;
+        }
+        fdcache_entry_release(&fe);
+        return cls;
+    } else if (req == &REQUEST_PUT) {
+        char *cl = conn_get_header(conn, "Content-Length");
+        if (cl == NULL) {
+            return CLASS_UNKNOWN;
+        }
+        return strtoull(cl, NULL, 10) > small_bytes ? CLASS_LARGE : CLASS_SMALL;
+    }
+    return CLASS_SMALL;
+}
+
+// hands parsed connections to the workers without blocking (it runs
+// on the poller's thread): round-robin onto the workers' deques in
+// work-stealing mode, onto their class's queue in class dispatch mode
+// (a full class does not hold up the others), else onto the shared
+// queue in one batch (one lock round trip, and a wakeup per
+// connection), or one by one when load is shed. Connections that find
+// no room are left to the poller, which offers them again
+int dispatch(conn_t **conns, const int *waited_ms, int n) {
+    int taken = 0;
+    if (sched != NULL) {
+        while (taken < n && sched_try_push(sched, conns[taken])) {
+            conns[taken++] = NULL;
+        }
+    } else if (cq != NULL) {
+        for (int i = 0; i < n; i++) {
+            if (classq_try_push(cq, conns[i], classify(conns[i]))) {
+                conns[i] = NULL;
+                taken++;
+            }
+        }
+    } else if (shed_ms > 0) {
+        while (taken < n && push_or_shed(conns[taken], waited_ms[taken])) {
+            conns[taken++] = NULL;
+        }
+    } else {
+        taken = queue_try_push_many(q, (void **) conns, n);
+        for (int i = 0; i < taken; i++) {
+            conns[i] = NULL;
+        }
+    }
+    return taken;
+}
+
+// queues conn if there's room, or else, once it has waited shed_ms for
+// room (or at once while shedding), answers it with 503 and closes it,
+// so overload turns into fast rejections instead of a backlog that
+// every client waits in. Returns false if conn should wait some more
+bool push_or_shed(conn_t *conn, int waited_ms) {
+    if (atomic_load(&shedding) && queue_length(q) <= queue_capacity / SHED_RESUME) {
+        atomic_store(&shedding, false);
+    }
+    if (queue_try_push(q, conn)) {
+        return true;
+    } else if (!atomic_load(&shedding) && waited_ms < shed_ms) {
+        return false;
+    }
+    atomic_store(&shedding, true);
+
+    const Request_t *req = conn_get_request(conn);
+    conn_set_last(conn);
+    conn_send_unavailable(conn, RETRY_AFTER);
+    metrics_response(metrics,
+        req == &REQUEST_GET   ? METHOD_GET
+        : req == &REQUEST_PUT ? METHOD_PUT
+                              : METHOD_OTHER,
+        response_get_code(&RESPONSE_SERVICE_UNAVAILABLE));
+    close(conn_get_fd(conn));
+    conn_delete(&conn);
+    return true;
+}
+
+void *handle_connection(void *arg) {
+    int id = (int) (uintptr_t) arg;
+    // pinned before anything of its own is allocated (its stack is
+    // touched first here too), so that is on its CPU's node
+    pin_thread(id + 1);
+    if (use_uring) {
+        // NULL (and so the default path) if this ring can't be set up
+        ring = uring_new(URING_ENTRIES);
+    }
     // worker thread
     while (1) {
-        // creates a new connection
-        uintptr_t connfd;
-        // pops from q to get connfd
-        // if q empty, worker thread get block
-        queue_pop(q, (void **) &connfd);
-        // creating new connection
-        conn_t *conn = conn_new(connfd);
-
-        // res is NULL when data from client is correctly formated
-        // else res points to a response that should be sent to client
-        const Response_t *res = conn_parse(conn);
-
-        // if the message is ill-formatted
-        if (res != NULL) {
-            conn_send_response(conn, res);
-            // if the message is correctly formatted
+        // pops a connection whose request was already parsed by the
+        // poller (ill-formatted requests are answered by the poller)
+        // if there is no work, worker thread get block
+        conn_t *conn;
+        classq_class_t cls = CLASS_SMALL;
+        atomic_fetch_add(&pool_idle, 1);
+        if (sched != NULL) {
+            sched_pop(sched, id, (void **) &conn);
+        } else if (cq != NULL) {
+            classq_pop(cq, (void **) &conn, &cls);
         } else {
-            // not sure what this does
-            debug("%s", conn_str(conn));
-            // returns request from parsing data from connections
-            const Request_t *req = conn_get_request(conn);
-            // if request is get
-            if (req == &REQUEST_GET) {
-                handle_get(conn);
-                // else if the requst is put
-            } else if (req == &REQUEST_PUT) {
-                handle_put(conn);
-                // else the request is unsupported
-            } else {
-                handle_unsupported(conn);
+            queue_pop(q, (void **) &conn);
+        }
+        atomic_fetch_sub(&pool_idle, 1);
+        atomic_store(&last_pop, now_ms());
+        worker_popped();
+
+        if (conn == (conn_t *) &retire_tag) {
+            classq_done(cq, cls);
+            if (retire()) {
+                break;
             }
+            continue;
+        }
+        serve(conn);
+        classq_done(cq, cls);
+    }
+    uring_delete(&ring);
+    return NULL;
+}
+
+// handles the parsed request on conn, and any that follow it on the
+// same connection while they are already buffered
+void serve(conn_t *conn) {
+    uint64_t busy = metrics_now(metrics);
+    do {
+        uint64_t start = metrics_now(metrics);
+        // not sure what this does
+        debug("%s", conn_str(conn));
+        // the last request on a kept-alive connection says so (and
+        // while draining, every request is the last)
+        if (keep_alive > 0
+            && (atomic_load(&draining) || conn_wants_close(conn)
+                || conn_get_count(conn) + 1 >= max_requests)) {
+            conn_set_last(conn);
+        }
+        // returns request from parsing data from connections
+        const Request_t *req = conn_get_request(conn);
+        // if request is get
+        if (req == &REQUEST_GET) {
+            handle_get(conn);
+            // else if the requst is put
+        } else if (req == &REQUEST_PUT) {
+            handle_put(conn);
+            // else the request is unsupported
+        } else {
+            handle_unsupported(conn);
         }
-        conn_delete(&conn);
-        close(connfd);
+        metrics_record(metrics, PHASE_REQUEST, start);
+    } while (next_request(conn));
+    metrics_busy(metrics, busy);
+}
+
+// serves a batch of parsed connections on the calling thread, one
+// after another
+int serve_all(conn_t **conns, const int *waited_ms, int n) {
+    (void) waited_ms;
+    for (int i = 0; i < n; i++) {
+        serve(conns[i]);
+        conns[i] = NULL;
+    }
+    return n;
+}
+
+// a worker with its own SO_REUSEPORT listener (-r): the kernel spreads
+// connections over the workers' listeners, and each worker's poller
+// hands parsed requests straight to serve() on the same thread, so no
+// connection crosses a queue
+void *handle_reuseport(void *arg) {
+    int id = (int) (uintptr_t) arg;
+    int cpu = pin_thread(id);
+    if (use_uring) {
+        ring = uring_new(URING_ENTRIES);
+    }
+    Listener_Socket sock;
+    if (listener_init_reuseport(&sock, listen_port) < 0) {
+        fprintf(stderr, "failed to listen on port %d in handle_reuseport()\n", listen_port);
+        exit(1);
+    }
+    if (steer && cpu >= 0 && affinity_steer(sock.fd, cpu) < 0) {
+        fprintf(stderr, "cannot steer connections to cpu %d\n", cpu);
     }
+    own_poller = poller_new(&sock, serve_all, HEADER_TIMEOUT, keep_alive, metrics);
+    register_poller(own_poller);
+    poller_run(own_poller);
+
+    // drained; nothing can be resumed to it from another thread
+    poller_delete(&own_poller);
+    uring_delete(&ring);
     return NULL;
 }
 
+// pins the calling thread to the slot'th CPU of the -A list (wrapping
+// around). Returns the CPU, or -1 if threads are not pinned
+int pin_thread(int slot) {
+    if (num_cpus == 0) {
+        return -1;
+    }
+    int cpu = cpus[slot % num_cpus];
+    if (affinity_pin(cpu) < 0) {
+        fprintf(stderr, "cannot pin a thread to cpu %d\n", cpu);
+        return -1;
+    }
+    debug("thread %d on cpu %d (node %d)", slot, cpu, affinity_node(cpu));
+    return cpu;
+}
+
+// decides what happens to a connection after a request. Returns true
+// if its next request was already buffered and parsed (pipelining), in
+// which case the same worker handles it. Otherwise the connection is
+// handed back to the poller to wait for its next request, or closed
+bool next_request(conn_t *conn) {
+    int connfd = conn_get_fd(conn);
+    if (keep_alive > 0 && conn_reusable(conn)) {
+        conn_reset(conn);
+        const Response_t *res = NULL;
+        uint64_t start = metrics_now(metrics);
+        ParseStatus status = conn_try_parse(conn, &res);
+        if (status == PARSE_DONE) {
+            metrics_record(metrics, PHASE_PARSE, start);
+        }
+        switch (status) {
+        case PARSE_AGAIN:
+            // back to the poller the connection came from
+            poller_resume(own_poller != NULL ? own_poller : poller, conn);
+            return false;
+        case PARSE_DONE:
+            if (res == NULL) {
+                return true;
+            }
+            conn_set_last(conn);
+            conn_send_response(conn, res);
+            metrics_response(metrics, METHOD_OTHER, response_get_code(res));
+            break;
+        case PARSE_CLOSED: break;
+        }
+    }
+    conn_delete(&conn);
+    close(connfd);
+    return false;
+}
+
+// done with a file that handle_get() opened: a cached one stays open
+// for the next GET
+void close_file(int fd, fdcache_entry_t **fe) {
+    if (*fe != NULL) {
+        fdcache_entry_release(fe);
+    } else {
+        close(fd);
+    }
+}
+
+// reads all size bytes of a file into a new buffer
+// returns NULL if the file could not be read in full
+char *read_file(int fd, uint64_t size) {
+    char *data = malloc(size > 0 ? size : 1);
+    uint64_t done = 0;
+    while (data != NULL && done < size) {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if (n <= 0) {
+            free(data);
+            data = NULL;
+        } else {
+            done += n;
+        }
+    }
+    return data;
+}
+
 void handle_get(conn_t *conn) {
     // retrieves the URI
     char *uri = conn_get_uri(conn);
@@ -152,17 +1025,81 @@ void handle_get(conn_t *conn) {
     // What are the steps in here?
 
     // 1. Open the file.
-    // lock
-    pthread_mutex_lock(&mutex);
-    int file_fd = open(uri, O_RDONLY);
+    // lock the URI as a reader while the file is opened: that is when
+    // the GET sees one version of the file, so the audit line is written
+    // before the lock is released. The body is sent afterwards from the
+    // open file, which a PUT's rename can no longer change
+    uint64_t t = metrics_now(metrics);
+    locktable_rdlock(locks, uri);
+    t = metrics_record(metrics, PHASE_LOCK, t);
     const Response_t *res = NULL;
+
+    // a hot file is served straight from memory. PUTs invalidate the
+    // entry while holding the writer lock, so a hit is never stale
+    // (with respect to this server's own writes). Ranges are sent from
+    // the file
+    bool ranged = conn_get_header(conn, "Range") != NULL;
+    cache_entry_t *entry = cache != NULL && !ranged ? cache_get(cache, uri) : NULL;
+    if (entry != NULL) {
+        debug("cache hit for %s", uri);
+        conn_set_validators(conn, cache_entry_stat(entry));
+        res = conn_not_modified(conn) ? &RESPONSE_NOT_MODIFIED : &RESPONSE_OK;
+        audit(conn, res);
+        locktable_unlock(locks, uri);
+        if (res == &RESPONSE_NOT_MODIFIED) {
+            conn_send_not_modified(conn);
+        } else {
+            conn_send_buf(conn, cache_entry_data(entry), cache_entry_size(entry));
+        }
+        metrics_record(metrics, PHASE_SEND, t);
+        cache_entry_release(&entry);
+        return;
+    }
+
+    // a hot file is already open, and its metadata known (or it is
+    // known not to exist): no path lookup at all
+    fdcache_entry_t *fe = fdcache != NULL ? fdcache_get(fdcache, uri) : NULL;
+    struct stat buffer;
+    int file_fd;
+    if (fe != NULL) {
+        file_fd = fdcache_entry_fd(fe);
+        buffer = *fdcache_entry_stat(fe);
+        errno = ENOENT;
+    } else {
+        uint64_t generation = fdcache != NULL ? fdcache_generation(fdcache, uri) : 0;
+        // open the file and get its size (2. with fstat); the io_uring
+        // engine does both in one submission
+        if (ring != NULL) {
+            file_fd = uring_open_stat(ring, uri, &buffer);
+            if (file_fd >= 0 && (S_ISFIFO(buffer.st_mode) || S_ISCHR(buffer.st_mode))) {
+                // io_uring opens a pipe without waiting for a writer, so
+                // reads would see end-of-file straight away: reopen it as
+                // the default path does, which waits for the writer
+                close(file_fd);
+                file_fd = open(uri, O_RDONLY);
+            }
+        } else {
+            file_fd = open(uri, O_RDONLY);
+            if (file_fd >= 0) {
+                fstat(file_fd, &buffer);
+            }
+        }
+        // cache the open file (or that there is none) while the reader
+        // lock is held, so it is never older than the last PUT. A pipe
+        // or device is read from, so its descriptor can't be shared
+        if (fdcache != NULL
+            && (file_fd >= 0 ? S_ISREG(buffer.st_mode) || S_ISDIR(buffer.st_mode)
+                             : errno == ENOENT)) {
+            fe = fdcache_put(fdcache, uri, file_fd, &buffer, generation);
+            errno = ENOENT;
+        }
+    }
     // If  open it returns < 0, then use the result appropriately
     //   a. Cannot access -- use RESPONSE_FORBIDDEN
     //   b. Cannot find the file -- use RESPONSE_NOT_FOUND
     //   c. other error? -- use RESPONSE_INTERNAL_SERVER_ERROR
     // (hint: check errno for these cases)!
     if (file_fd < 0) {
-        pthread_mutex_unlock(&mutex);
         debug("%s: %d", uri, errno);
         if (errno == EACCES) {
             res = &RESPONSE_FORBIDDEN;
@@ -172,20 +1109,17 @@ void handle_get(conn_t *conn) {
             // could trigger because it's a directory?
             res = &RESPONSE_INTERNAL_SERVER_ERROR;
         }
-        conn_send_response(conn, res);
 
         // audit
         audit(conn, res);
+        locktable_unlock(locks, uri);
+        t = metrics_record(metrics, PHASE_DISK, t);
+        conn_send_response(conn, res);
+        metrics_record(metrics, PHASE_SEND, t);
+        fdcache_entry_release(&fe);
         return;
     }
 
-    flock(file_fd, LOCK_SH);
-    pthread_mutex_unlock(&mutex);
-
-    // 2. Get the size of the file.
-    // (hint: checkout the function fstat)!
-    struct stat buffer;
-    fstat(file_fd, &buffer);
     uint64_t size = buffer.st_size;
 
     // 3. Check if the file is a directory, because directories *will*
@@ -193,20 +1127,71 @@ void handle_get(conn_t *conn) {
     // (hint: checkout the macro "S_IFDIR", which you can use after you call fstat!)
     if (S_ISDIR(buffer.st_mode)) {
         res = &RESPONSE_FORBIDDEN;
-        conn_send_response(conn, res);
-        close(file_fd);
         audit(conn, res);
+        locktable_unlock(locks, uri);
+        t = metrics_record(metrics, PHASE_DISK, t);
+        conn_send_response(conn, res);
+        metrics_record(metrics, PHASE_SEND, t);
+        close_file(file_fd, &fe);
         return;
     }
 
+    // a client that already holds this version of the file gets 304
+    // (no body, so nothing is read or cached)
+    if (S_ISREG(buffer.st_mode)) {
+        conn_set_validators(conn, &buffer);
+        if (conn_not_modified(conn)) {
+            res = &RESPONSE_NOT_MODIFIED;
+            audit(conn, res);
+            locktable_unlock(locks, uri);
+            t = metrics_record(metrics, PHASE_DISK, t);
+            conn_send_not_modified(conn);
+            metrics_record(metrics, PHASE_SEND, t);
+            close_file(file_fd, &fe);
+            return;
+        }
+    }
+
+    // a GET of part of a file (which is resolved against the version
+    // that was opened)
+    ByteRange ranges[MAX_RANGES];
+    int nranges = ranged && S_ISREG(buffer.st_mode)
+                      ? conn_get_ranges(conn, size, ranges, MAX_RANGES)
+                      : 0;
+
+    // a small file is read into memory (and cached) while the lock is
+    // still held, so the cache never gets a version older than the last
+    // PUT
+    char *data = NULL;
+    if (cache != NULL && nranges == 0 && S_ISREG(buffer.st_mode) && size <= cache_max_object
+        && (data = read_file(file_fd, size)) != NULL) {
+        cache_put(cache, uri, data, size, &buffer);
+    }
+    res = nranges > 0    ? &RESPONSE_PARTIAL_CONTENT
+          : nranges < 0 ? &RESPONSE_RANGE_NOT_SATISFIABLE
+                        : &RESPONSE_OK;
+    audit(conn, res);
+    locktable_unlock(locks, uri);
+    t = metrics_record(metrics, PHASE_DISK, t);
+
     // 4. Send the file
     // (hint: checkout the conn_send_file function!)
-    res = &RESPONSE_OK;
-    conn_send_file(conn, file_fd, size);
-    //flock(file_fd, LOCK_UN);
-    audit(conn, res);
-    close(file_fd);
-    //audit(conn, res);
+    if (nranges != 0) {
+        conn_send_ranges(conn, file_fd, size, ranges, nranges);
+    } else if (!S_ISREG(buffer.st_mode)) {
+        // a pipe or device has no size to send up front: stream it
+        conn_send_stream(conn, file_fd);
+    } else if (data != NULL) {
+        conn_send_buf(conn, data, size);
+        free(data);
+    } else if (ring != NULL && S_ISREG(buffer.st_mode) && size <= URING_MAX_FILE) {
+        // read and send in one submission
+        conn_send_file_uring(conn, ring, file_fd, size);
+    } else {
+        conn_send_file(conn, file_fd, size);
+    }
+    metrics_record(metrics, PHASE_SEND, t);
+    close_file(file_fd, &fe);
 }
 
 void handle_unsupported(conn_t *conn) {
@@ -217,52 +1202,138 @@ void handle_unsupported(conn_t *conn) {
     audit(conn, &RESPONSE_NOT_IMPLEMENTED);
 }
 
+// whether a PUT may replace the file uri that st describes: not a
+// directory, and writable by us. The mode answers for our own files
+// (and our group's) without a system call, as st may come from the
+// open-file cache; any other group membership is access(W_OK)'s to check
+bool may_replace(const char *uri, const struct stat *st) {
+    if (S_ISDIR(st->st_mode)) {
+        return false;
+    } else if (server_uid == 0) {
+        return true;
+    } else if (st->st_uid == server_uid) {
+        return st->st_mode & S_IWUSR;
+    } else if (st->st_gid == server_gid) {
+        return st->st_mode & S_IWGRP;
+    }
+    return access(uri, W_OK) == 0;
+}
+
+// Called with the URI's writer lock held: whether the file that a PUT
+// looked at before receiving its body (exists, st, and fe if that came
+// from the open-file cache) has been replaced since. Every PUT drops
+// the cached entry under this lock (and the watcher drops it for any
+// other change), so an entry that is still cached needs no system call
+bool put_target_moved(
+    const char *uri, const fdcache_entry_t *fe, bool exists, const struct stat *st) {
+    if (fe != NULL) {
+        fdcache_entry_t *now = fdcache_peek(fdcache, uri);
+        bool moved = now != fe;
+        fdcache_entry_release(&now);
+        return moved;
+    }
+    struct stat now;
+    if (stat(uri, &now) != 0) {
+        return exists;
+    }
+    return !exists || now.st_ino != st->st_ino || now.st_dev != st->st_dev
+           || now.st_mode != st->st_mode || now.st_uid != st->st_uid
+           || now.st_gid != st->st_gid;
+}
+
 void handle_put(conn_t *conn) {
 
     char *uri = conn_get_uri(conn);
     const Response_t *res = NULL;
     debug("handling put request for %s", uri);
 
-    // lock
-    pthread_mutex_lock(&mutex);
-    // Check if file already exists before opening it.
-    bool existed = access(uri, F_OK) == 0;
-    debug("%s existed? %d", uri, existed);
-
-    // Open the file..
-    int fd = open(uri, O_CREAT | O_WRONLY, 0600);
-    if (fd < 0) {
-        // unlock
-        pthread_mutex_unlock(&mutex);
-        debug("%s: %d", uri, errno);
-        if (errno == EACCES || errno == EISDIR || errno == ENOENT) {
-            res = &RESPONSE_FORBIDDEN;
-        } else {
+    // a file that we could not have opened for writing is forbidden;
+    // a cached entry says so (and whether the file exists) without a
+    // system call
+    uint64_t t = metrics_now(metrics);
+    struct stat st;
+    fdcache_entry_t *fe = fdcache != NULL ? fdcache_get(fdcache, uri) : NULL;
+    bool exists;
+    if (fe != NULL) {
+        exists = fdcache_entry_fd(fe) >= 0;
+        st = *fdcache_entry_stat(fe);
+    } else {
+        exists = stat(uri, &st) == 0;
+    }
+    if (exists && !may_replace(uri, &st)) {
+        res = &RESPONSE_FORBIDDEN;
+    }
+
+    // Receive the body into a temporary file next to the URI, without
+    // holding any lock: GETs keep serving the current version meanwhile
+    char tmp[] = PUT_TEMPLATE;
+    int fd = -1;
+    if (res == NULL) {
+        fd = mkstemp(tmp);
+        if (fd < 0) {
+            debug("mkstemp: %d", errno);
             res = &RESPONSE_INTERNAL_SERVER_ERROR;
+        } else {
+            if (exists) {
+                fchmod(fd, st.st_mode & 07777);
+            }
+            // write data from the connection to the file fd
+            res = conn_recv_file(conn, fd);
+            close(fd);
+            if (res != NULL) {
+                unlink(tmp);
+            }
         }
-        conn_send_response(conn, res);
-        audit(conn, res);
-        return;
     }
 
-    flock(fd, LOCK_EX);
-    // unlock
-    pthread_mutex_unlock(&mutex);
+    // creating and filling the temporary file is the receive phase; a
+    // PUT that got no further spent its time on the stat
+    t = metrics_record(metrics, fd >= 0 ? PHASE_RECV : PHASE_DISK, t);
 
-    // use stat to get the size of the file to truncate
-    int t = ftruncate(fd, 0);
-    assert(!t);
-    //pthread_mutex_unlock(&mutex);
-    // write data from the connection to the file fd
-    res = conn_recv_file(conn, fd);
-
-    if (res == NULL && existed) {
-        res = &RESPONSE_OK;
-    } else if (res == NULL && !existed) {
-        res = &RESPONSE_CREATED;
+    // Publish it: the rename is atomic, so a GET opens either the old or
+    // the new file, never a partial one. The writer lock is held only
+    // around the rename, so whether the URI existed, the cache and the
+    // audit line all agree with the order of the renames
+    locktable_wrlock(locks, uri);
+    t = metrics_record(metrics, PHASE_LOCK, t);
+    if (res == NULL && put_target_moved(uri, fe, exists, &st)) {
+        // another PUT (or a change behind our back) got in while the
+        // body arrived: look again, so the answer, the check and the
+        // mode all describe the file that this rename replaces
+        exists = stat(uri, &st) == 0;
+        if (exists && !may_replace(uri, &st)) {
+            res = &RESPONSE_FORBIDDEN;
+            unlink(tmp);
+        } else {
+            chmod(tmp, exists ? st.st_mode & 07777 : S_IRUSR | S_IWUSR);
+        }
+    }
+    fdcache_entry_release(&fe);
+    if (res == NULL) {
+        debug("%s existed? %d", uri, exists);
+        if (rename(tmp, uri) < 0) {
+            debug("rename %s: %d", uri, errno);
+            res = errno == EACCES || errno == EISDIR ? &RESPONSE_FORBIDDEN
+                                                     : &RESPONSE_INTERNAL_SERVER_ERROR;
+            unlink(tmp);
+        } else {
+            res = exists ? &RESPONSE_OK : &RESPONSE_CREATED;
+        }
+        // whatever happened, the cached copy (and open file) may no
+        // longer be the file
+        if (cache != NULL) {
+            cache_invalidate(cache, uri);
+        }
+        if (fdcache != NULL) {
+            fdcache_invalidate(fdcache, uri);
+        }
     }
-    conn_send_response(conn, res);
     audit(conn, res);
-    close(fd);
-    // audit(conn, res);
+    locktable_unlock(locks, uri);
+    if (fd >= 0) {
+        t = metrics_record(metrics, PHASE_DISK, t); // the rename
+    }
+
+    conn_send_response(conn, res);
+    metrics_record(metrics, PHASE_SEND, t);
 }
@@ -0,0 +1,56 @@
+#define _GNU_SOURCE
+
+#include "asgn2_helper_funcs.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// the length of the queue of connections that haven't been accepted yet
+#define BACKLOG 128
+
+// seconds that a read from (or write to) an accepted socket may block
+#define SOCKET_TIMEOUT 5
+
+static int listen_on(Listener_Socket *sock, int port, bool reuseport) {
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_ANY) };
+    addr.sin_port = htons(port);
+
+    sock->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    if (reuseport && setsockopt(sock->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        close(sock->fd);
+        return -1;
+    }
+    if (bind(sock->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+        || listen(sock->fd, BACKLOG) < 0) {
+        close(sock->fd);
+        return -1;
+    }
+    return 0;
+}
+
+int listener_init(Listener_Socket *sock, int port) {
+    return listen_on(sock, port, false);
+}
+
+int listener_init_reuseport(Listener_Socket *sock, int port) {
+    return listen_on(sock, port, true);
+}
+
+int listener_accept(Listener_Socket *sock) {
+    // accept4 sets close-on-exec in the same call
+    int connfd = accept4(sock->fd, NULL, NULL, SOCK_CLOEXEC);
+    if (connfd >= 0) {
+        struct timeval tv = { .tv_sec = SOCKET_TIMEOUT, .tv_usec = 0 };
+        setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return connfd;
+}
@@ -0,0 +1,82 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "locktable.h"
+
+#define CACHE_LINE 64
+
+// one lock per cache line, so neighbouring stripes don't false share
+typedef union stripe {
+    pthread_rwlock_t lock;
+    char pad[CACHE_LINE * ((sizeof(pthread_rwlock_t) + CACHE_LINE - 1) / CACHE_LINE)];
+} stripe;
+
+typedef struct locktable {
+    int size; // number of stripes
+    stripe *stripes;
+} locktable;
+
+locktable_t *locktable_new(int stripes) {
+    locktable_t *lt = malloc(sizeof(locktable));
+    if (lt == NULL) {
+        fprintf(stderr, "failed to create new lock table in locktable_new()\n");
+        exit(1);
+    }
+    lt->stripes = aligned_alloc(CACHE_LINE, stripes * sizeof(stripe));
+    if (lt->stripes == NULL) {
+        fprintf(stderr, "failed to allocate stripes in locktable_new()\n");
+        exit(1);
+    }
+
+    // prefer writers, so that a steady stream of GETs can't starve a PUT
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < stripes; i++) {
+        int rc = pthread_rwlock_init(&lt->stripes[i].lock, &attr);
+        assert(!rc);
+        (void) rc;
+    }
+    pthread_rwlockattr_destroy(&attr);
+
+    lt->size = stripes;
+    return lt;
+}
+
+void locktable_delete(locktable_t **lt) {
+    if (lt != NULL && *lt != NULL) {
+        for (int i = 0; i < (*lt)->size; i++) {
+            pthread_rwlock_destroy(&(*lt)->stripes[i].lock);
+        }
+        free((*lt)->stripes);
+        free(*lt);
+        *lt = NULL;
+    }
+}
+
+// FNV-1a
+static pthread_rwlock_t *lookup(locktable_t *lt, const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *) key; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    return &lt->stripes[h % lt->size].lock;
+}
+
+void locktable_rdlock(locktable_t *lt, const char *key) {
+    pthread_rwlock_rdlock(lookup(lt, key));
+}
+
+void locktable_wrlock(locktable_t *lt, const char *key) {
+    pthread_rwlock_wrlock(lookup(lt, key));
+}
+
+void locktable_unlock(locktable_t *lt, const char *key) {
+    pthread_rwlock_unlock(lookup(lt, key));
+}
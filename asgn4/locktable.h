@@ -0,0 +1,53 @@
+/**
+ * @File locktable.h
+ *
+ * A striped table of reader-writer locks keyed by URI.  Every URI
+ * hashes to one stripe, so requests on different files (almost) never
+ * contend, and readers of the same file share their stripe.
+ */
+
+#pragma once
+
+/** @struct locktable_t
+ *
+ *  @brief This typedef renames the struct locktable.
+ */
+typedef struct locktable locktable_t;
+
+/** @brief Dynamically allocates and initializes a new lock table.
+ *
+ *  @param stripes the number of locks in the table.
+ *
+ *  @return a pointer to a new locktable_t
+ */
+locktable_t *locktable_new(int stripes);
+
+/** @brief Delete a lock table and free all of its memory.
+ *
+ *  @param lt the table to be deleted.  *lt is set to NULL.
+ */
+void locktable_delete(locktable_t **lt);
+
+/** @brief Acquire the lock for key in shared (reader) mode.
+ *
+ *  @param lt the lock table.
+ *
+ *  @param key the URI to lock.
+ */
+void locktable_rdlock(locktable_t *lt, const char *key);
+
+/** @brief Acquire the lock for key in exclusive (writer) mode.
+ *
+ *  @param lt the lock table.
+ *
+ *  @param key the URI to lock.
+ */
+void locktable_wrlock(locktable_t *lt, const char *key);
+
+/** @brief Release the lock for key, in whichever mode it is held.
+ *
+ *  @param lt the lock table.
+ *
+ *  @param key the URI to unlock.
+ */
+void locktable_unlock(locktable_t *lt, const char *key);
@@ -0,0 +1,384 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "asgn2_helper_funcs.h"
+#include "metrics.h"
+
+#define CACHE_LINE 64
+
+// HDR-style buckets: values below SUB nanoseconds get a bucket each,
+// and every power of two above that is split into SUB buckets, so a
+// bucket is within 1/SUB (12.5%) of any value in it.  Values of 2^MAX_EXP
+// nanoseconds (18 minutes) and more share the last bucket.
+#define SUB_BITS 3
+#define SUB      (1 << SUB_BITS)
+#define MAX_EXP  40
+#define BUCKETS  ((MAX_EXP - SUB_BITS + 2) * SUB)
+
+// status codes 100 to 599 are counted
+#define MIN_CODE 100
+#define CODES    500
+
+typedef struct histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum; // nanoseconds
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[BUCKETS];
+} histogram;
+
+// One thread's metrics.  Only the owning thread writes a block (so it
+// adds with a load and a store, not a locked read-modify-write), and a
+// scrape reads every block.  The block of a thread that exited is
+// reused by the next new thread, which keeps adding to its counts.
+typedef struct block {
+    histogram phases[PHASE_COUNT];
+    _Atomic uint64_t responses[METHOD_COUNT][CODES];
+    _Atomic uint64_t connections;
+    _Atomic uint64_t busy; // nanoseconds
+    _Atomic bool owned;
+    struct block *next; // in the list of blocks; never removed
+} block;
+
+typedef struct metrics {
+    uint64_t start; // nanoseconds
+    _Atomic(block *) blocks;
+    pthread_key_t key; // releases a thread's block when it exits
+
+    // the admin endpoint
+    Listener_Socket sock;
+    metrics_extra_fn extra;
+    pthread_t server;
+    _Atomic bool stop; // set by metrics_delete, which then shuts sock down
+} metrics;
+
+static const char *phase_names[PHASE_COUNT]
+    = { "parse", "lock", "disk", "recv", "send", "request" };
+static const char *method_names[METHOD_COUNT] = { "GET", "PUT", "OTHER" };
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+static __thread block *my_block = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void release_block(void *b) {
+    atomic_store(&((block *) b)->owned, false);
+}
+
+metrics_t *metrics_new(void) {
+    metrics_t *m = malloc(sizeof(metrics));
+    if (m == NULL) {
+        fprintf(stderr, "failed to create new metrics in metrics_new()\n");
+        exit(1);
+    }
+    m->start = now_ns();
+    atomic_init(&m->blocks, NULL);
+    m->extra = NULL;
+    m->sock.fd = -1;
+    atomic_init(&m->stop, false);
+    int rc = pthread_key_create(&m->key, release_block);
+    assert(!rc);
+    (void) rc;
+    return m;
+}
+
+void metrics_delete(metrics_t **m) {
+    if (m != NULL && *m != NULL) {
+        if ((*m)->sock.fd >= 0) {
+            // not a cancel: the thread may be inside stdio, whose locks
+            // and memstream a cancel would leave behind. The shutdown
+            // makes its accept fail, and a scrape in progress finishes
+            atomic_store(&(*m)->stop, true);
+            shutdown((*m)->sock.fd, SHUT_RDWR);
+            pthread_join((*m)->server, NULL);
+            close((*m)->sock.fd);
+        }
+        block *b = atomic_load(&(*m)->blocks);
+        while (b != NULL) {
+            block *next = b->next;
+            free(b);
+            b = next;
+        }
+        // a thread that recorded must not find its (freed) block again
+        my_block = NULL;
+        pthread_key_delete((*m)->key);
+        free(*m);
+        *m = NULL;
+    }
+}
+
+// Find the calling thread's block, claiming one on first use.
+static block *get_block(metrics_t *m) {
+    if (my_block != NULL) {
+        return my_block;
+    }
+
+    // reuse the block of a thread that exited
+    for (block *b = atomic_load(&m->blocks); b != NULL; b = b->next) {
+        bool owned = false;
+        if (!atomic_load(&b->owned) && atomic_compare_exchange_strong(&b->owned, &owned, true)) {
+            my_block = b;
+            break;
+        }
+    }
+
+    if (my_block == NULL) {
+        size_t bytes = (sizeof(block) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        block *b = aligned_alloc(CACHE_LINE, bytes);
+        if (b == NULL) {
+            fprintf(stderr, "failed to allocate block in metrics_record()\n");
+            exit(1);
+        }
+        memset(b, 0, sizeof(block)); // all-zero atomics are zero
+        atomic_init(&b->owned, true);
+        b->next = atomic_load(&m->blocks);
+        while (!atomic_compare_exchange_weak(&m->blocks, &b->next, b)) {
+        }
+        my_block = b;
+    }
+    pthread_setspecific(m->key, my_block);
+    return my_block;
+}
+
+// Add n to a counter that only the calling thread writes.
+static void add(_Atomic uint64_t *counter, uint64_t n) {
+    uint64_t v = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, v + n, memory_order_relaxed);
+}
+
+static int bucket_of(uint64_t v) {
+    if (v < SUB) {
+        return (int) v;
+    }
+    int e = 63 - __builtin_clzll(v);
+    if (e > MAX_EXP) {
+        return BUCKETS - 1;
+    }
+    return (e - SUB_BITS + 1) * SUB + (int) ((v >> (e - SUB_BITS)) & (SUB - 1));
+}
+
+// The smallest value in bucket i.
+static uint64_t bucket_floor(int i) {
+    if (i < SUB) {
+        return i;
+    }
+    int e = i / SUB + SUB_BITS - 1;
+    return (uint64_t) (SUB + i % SUB) << (e - SUB_BITS);
+}
+
+uint64_t metrics_now(metrics_t *m) {
+    return m != NULL ? now_ns() : 0;
+}
+
+uint64_t metrics_record(metrics_t *m, metrics_phase_t phase, uint64_t start) {
+    if (m == NULL) {
+        return 0;
+    }
+    uint64_t now = now_ns();
+    uint64_t ns = now > start ? now - start : 0;
+    histogram *h = &get_block(m)->phases[phase];
+    add(&h->count, 1);
+    add(&h->sum, ns);
+    add(&h->buckets[bucket_of(ns)], 1);
+    if (ns > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+    }
+    return now;
+}
+
+void metrics_response(metrics_t *m, metrics_method_t method, uint16_t code) {
+    if (m != NULL && code >= MIN_CODE && code < MIN_CODE + CODES) {
+        add(&get_block(m)->responses[method][code - MIN_CODE], 1);
+    }
+}
+
+void metrics_connection(metrics_t *m) {
+    if (m != NULL) {
+        add(&get_block(m)->connections, 1);
+    }
+}
+
+void metrics_busy(metrics_t *m, uint64_t start) {
+    if (m != NULL) {
+        uint64_t now = now_ns();
+        add(&get_block(m)->busy, now > start ? now - start : 0);
+    }
+}
+
+double metrics_busy_seconds(metrics_t *m) {
+    uint64_t busy = 0;
+    if (m != NULL) {
+        for (block *b = atomic_load(&m->blocks); b != NULL; b = b->next) {
+            busy += atomic_load_explicit(&b->busy, memory_order_relaxed);
+        }
+    }
+    return busy / 1e9;
+}
+
+double metrics_uptime(metrics_t *m) {
+    return m != NULL ? (now_ns() - m->start) / 1e9 : 0;
+}
+
+// Sum one phase's histograms over every block into h.
+static void merge(metrics_t *m, metrics_phase_t phase, uint64_t *h, uint64_t *count,
+    uint64_t *sum, uint64_t *max) {
+    memset(h, 0, BUCKETS * sizeof(uint64_t));
+    *count = *sum = *max = 0;
+    for (block *b = atomic_load(&m->blocks); b != NULL; b = b->next) {
+        histogram *p = &b->phases[phase];
+        for (int i = 0; i < BUCKETS; i++) {
+            h[i] += atomic_load_explicit(&p->buckets[i], memory_order_relaxed);
+        }
+        *count += atomic_load_explicit(&p->count, memory_order_relaxed);
+        *sum += atomic_load_explicit(&p->sum, memory_order_relaxed);
+        uint64_t bmax = atomic_load_explicit(&p->max, memory_order_relaxed);
+        *max = bmax > *max ? bmax : *max;
+    }
+}
+
+// The value (in nanoseconds) below which a fraction q of the merged
+// histogram h falls: the top of its bucket, but never more than max.
+static uint64_t quantile(const uint64_t *h, uint64_t count, uint64_t max, double q) {
+    uint64_t rank = (uint64_t) (q * count + 0.5), seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+        seen += h[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t top = bucket_floor(i + 1) - 1;
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+void metrics_write(metrics_t *m, FILE *out) {
+    if (m == NULL) {
+        return;
+    }
+
+    uint64_t h[BUCKETS], count, sum, max;
+    fprintf(out, "# HELP httpserver_phase_seconds Time spent in each phase of a request.\n"
+                 "# TYPE httpserver_phase_seconds summary\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        merge(m, p, h, &count, &sum, &max);
+        for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+            fprintf(out, "httpserver_phase_seconds{phase=\"%s\",quantile=\"%g\"} %.9f\n",
+                phase_names[p], quantiles[i], quantile(h, count, max, quantiles[i]) / 1e9);
+        }
+        fprintf(out, "httpserver_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[p], sum / 1e9);
+        fprintf(out, "httpserver_phase_seconds_count{phase=\"%s\"} %lu\n", phase_names[p], count);
+    }
+    fprintf(out, "# HELP httpserver_phase_seconds_max The longest time spent in each phase.\n"
+                 "# TYPE httpserver_phase_seconds_max gauge\n");
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        merge(m, p, h, &count, &sum, &max);
+        fprintf(out, "httpserver_phase_seconds_max{phase=\"%s\"} %.9f\n", phase_names[p], max / 1e9);
+    }
+
+    fprintf(out, "# HELP httpserver_responses_total Responses sent, by method and status code.\n"
+                 "# TYPE httpserver_responses_total counter\n");
+    for (int method = 0; method < METHOD_COUNT; method++) {
+        for (int code = 0; code < CODES; code++) {
+            uint64_t n = 0;
+            for (block *b = atomic_load(&m->blocks); b != NULL; b = b->next) {
+                n += atomic_load_explicit(&b->responses[method][code], memory_order_relaxed);
+            }
+            if (n > 0) {
+                fprintf(out, "httpserver_responses_total{method=\"%s\",code=\"%d\"} %lu\n",
+                    method_names[method], code + MIN_CODE, n);
+            }
+        }
+    }
+
+    uint64_t connections = 0;
+    for (block *b = atomic_load(&m->blocks); b != NULL; b = b->next) {
+        connections += atomic_load_explicit(&b->connections, memory_order_relaxed);
+    }
+    fprintf(out,
+        "# HELP httpserver_connections_total Connections accepted.\n"
+        "# TYPE httpserver_connections_total counter\n"
+        "httpserver_connections_total %lu\n"
+        "# HELP httpserver_worker_busy_seconds_total Time workers spent serving requests.\n"
+        "# TYPE httpserver_worker_busy_seconds_total counter\n"
+        "httpserver_worker_busy_seconds_total %.6f\n"
+        "# HELP httpserver_uptime_seconds Time since the server started.\n"
+        "# TYPE httpserver_uptime_seconds gauge\n"
+        "httpserver_uptime_seconds %.3f\n",
+        connections, metrics_busy_seconds(m), metrics_uptime(m));
+}
+
+static void *server_thread(void *arg) {
+    metrics_t *m = arg;
+    while (!atomic_load(&m->stop)) {
+        int connfd = listener_accept(&m->sock);
+        if (connfd < 0) {
+            continue;
+        }
+
+        // the request itself doesn't matter: read its headers (or
+        // whatever arrives before the accept timeout) and answer
+        char req[2048];
+        size_t got = 0;
+        while (got < sizeof(req) - 1) {
+            ssize_t n = read(connfd, req + got, sizeof(req) - 1 - got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+            req[got] = '\0';
+            if (strstr(req, "\r\n\r\n") != NULL) {
+                break;
+            }
+        }
+
+        char *body = NULL;
+        size_t len = 0;
+        FILE *out = open_memstream(&body, &len);
+        if (out != NULL) {
+            metrics_write(m, out);
+            if (m->extra != NULL) {
+                m->extra(m, out);
+            }
+            fclose(out);
+
+            char head[256];
+            int n = snprintf(head, sizeof(head),
+                "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                len);
+            if (write_all(connfd, head, n) == n) {
+                write_all(connfd, body, len);
+            }
+            free(body);
+        }
+        close(connfd);
+    }
+    return NULL;
+}
+
+int metrics_serve(metrics_t *m, int port, metrics_extra_fn extra) {
+    if (listener_init(&m->sock, port) < 0) {
+        m->sock.fd = -1;
+        return -1;
+    }
+    m->extra = extra;
+    if (pthread_create(&m->server, NULL, server_thread, m) != 0) {
+        fprintf(stderr, "failed to start metrics thread in metrics_serve()\n");
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,146 @@
+/**
+ * @File metrics.h
+ *
+ * Runtime metrics: request counters and HDR-style latency histograms
+ * for the phases of a request.  Every thread records into its own
+ * block with plain (single-writer) atomic stores, so recording takes no
+ * lock and shares no cache line; a scrape sums the blocks.  The metrics
+ * are served in the Prometheus text format on a separate admin port.
+ *
+ * Every function accepts a NULL metrics_t and then does nothing, so
+ * callers need not check whether metrics are turned on.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+/** @brief The phases of a request that are timed.
+ */
+typedef enum {
+    PHASE_PARSE, // parsing a request whose headers have arrived
+    PHASE_LOCK, // waiting for the URI's lock
+    PHASE_DISK, // opening, reading, renaming files
+    PHASE_RECV, // receiving a PUT's body
+    PHASE_SEND, // sending a response
+    PHASE_REQUEST, // the whole request, from when a worker picks it up
+    PHASE_COUNT,
+} metrics_phase_t;
+
+/** @brief The methods that responses are counted by.
+ */
+typedef enum {
+    METHOD_GET,
+    METHOD_PUT,
+    METHOD_OTHER, // unsupported or unparsable requests
+    METHOD_COUNT,
+} metrics_method_t;
+
+/** @struct metrics_t
+ *
+ *  @brief This typedef renames the struct metrics.
+ */
+typedef struct metrics metrics_t;
+
+/** @brief A function that appends more metrics (e.g., gauges owned by
+ *         the server) to a scrape, in the Prometheus text format.
+ */
+typedef void (*metrics_extra_fn)(metrics_t *m, FILE *out);
+
+/** @brief Dynamically allocates and initializes the metrics.  Only one
+ *         metrics_t may exist at a time (each thread's block is found
+ *         through a thread-local pointer).
+ *
+ *  @return a pointer to a new metrics_t
+ */
+metrics_t *metrics_new(void);
+
+/** @brief Delete the metrics.  No thread may record anymore.
+ *
+ *  @param m the metrics to be deleted.  *m is set to NULL.
+ */
+void metrics_delete(metrics_t **m);
+
+/** @brief The current time, to pass to metrics_record later.
+ *
+ *  @param m the metrics.
+ *
+ *  @return monotonic nanoseconds, or 0 if m is NULL (so no clock is
+ *          read when metrics are off).
+ */
+uint64_t metrics_now(metrics_t *m);
+
+/** @brief Record that a phase took from start until now.
+ *
+ *  @param m the metrics.
+ *
+ *  @param phase the phase.
+ *
+ *  @param start the value of metrics_now when the phase started.
+ *
+ *  @return the current time, so that the next phase can start from it.
+ */
+uint64_t metrics_record(metrics_t *m, metrics_phase_t phase, uint64_t start);
+
+/** @brief Count a response.
+ *
+ *  @param m the metrics.
+ *
+ *  @param method the request's method.
+ *
+ *  @param code the response's status code.
+ */
+void metrics_response(metrics_t *m, metrics_method_t method, uint16_t code);
+
+/** @brief Count an accepted connection.
+ *
+ *  @param m the metrics.
+ */
+void metrics_connection(metrics_t *m);
+
+/** @brief Add to the time that the calling worker spent busy (serving
+ *         requests, as opposed to waiting for them).
+ *
+ *  @param m the metrics.
+ *
+ *  @param start the value of metrics_now when the work started.
+ */
+void metrics_busy(metrics_t *m, uint64_t start);
+
+/** @brief The total time that all workers have spent busy.
+ *
+ *  @param m the metrics.
+ *
+ *  @return seconds.
+ */
+double metrics_busy_seconds(metrics_t *m);
+
+/** @brief The time since the metrics were created.
+ *
+ *  @param m the metrics.
+ *
+ *  @return seconds.
+ */
+double metrics_uptime(metrics_t *m);
+
+/** @brief Write every metric, in the Prometheus text format.
+ *
+ *  @param m the metrics.
+ *
+ *  @param out where to write them.
+ */
+void metrics_write(metrics_t *m, FILE *out);
+
+/** @brief Start a thread that answers every HTTP request on port with
+ *         the metrics (followed by what extra writes).
+ *
+ *  @param m the metrics.
+ *
+ *  @param port the admin port.
+ *
+ *  @param extra a function that writes more metrics, or NULL.
+ *
+ *  @return 0, or -1 if the port can't be listened on.
+ */
+int metrics_serve(metrics_t *m, int port, metrics_extra_fn extra);
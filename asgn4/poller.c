@@ -0,0 +1,516 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "debug.h"
+#include "metrics.h"
+#include "poller.h"
+#include "response.h"
+
+#define MAX_EVENTS 64
+
+// the most parsed connections that are dispatched at once
+#define MAX_BATCH 64
+
+// how often parsed connections that the workers had no room for are
+// offered again (ms)
+#define DISPATCH_RETRY 1
+
+// A connection whose request has not fully arrived yet, or has been
+// parsed and waits for room in the workers' queue.  Pending connections
+// are kept in lists ordered by their deadline, which is also the order
+// in which they were added: every connection on a list gets the same
+// timeout.
+typedef struct pending {
+    conn_t *conn;
+    int fd;
+    bool idle; // kept alive, and no byte of the next request has arrived
+    bool ready; // parsed; deadline is when it was
+    struct timespec deadline;
+    struct pending *prev;
+    struct pending *next;
+} pending;
+
+typedef struct pending_list {
+    pending *head; // earliest deadline
+    pending *tail; // latest deadline
+} pending_list;
+
+typedef struct poller {
+    Listener_Socket *sock;
+    dispatch_fn dispatch;
+    metrics_t *metrics; // may be NULL
+    int timeout; // seconds
+    int idle_timeout; // seconds
+    int epfd;
+    pending_list fresh; // waiting on the rest of a request
+    pending_list idle; // waiting on the first byte of a request
+    pending_list ready; // parsed, waiting to be dispatched
+
+    // connections handed back by workers, added to epoll by the loop
+    pthread_mutex_t mutex;
+    pending *resumed;
+    pending *spare; // unused pendings for poller_resume
+    int evfd; // signaled when resumed is not empty, or to stop
+
+    // unused pendings for the loop, given to spare by add_resumed: a
+    // pending is freed by the loop and taken by a worker once per
+    // kept-alive request, so they are recycled instead
+    pending *free_list;
+
+    _Atomic bool stopping; // set by poller_stop
+    bool closed; // the listener was closed
+} poller;
+
+// Tags for the listener and the eventfd in epoll_event.data.ptr
+static char listener_tag;
+static char resume_tag;
+
+poller_t *poller_new(Listener_Socket *sock, dispatch_fn dispatch, int timeout, int idle_timeout,
+    metrics_t *metrics) {
+    poller_t *p = malloc(sizeof(poller));
+    if (p == NULL) {
+        fprintf(stderr, "failed to create new poller in poller_new()\n");
+        exit(1);
+    }
+    p->sock = sock;
+    p->dispatch = dispatch;
+    p->metrics = metrics;
+    p->timeout = timeout;
+    p->idle_timeout = idle_timeout;
+    p->fresh.head = p->fresh.tail = NULL;
+    p->idle.head = p->idle.tail = NULL;
+    p->ready.head = p->ready.tail = NULL;
+    p->resumed = NULL;
+    p->spare = NULL;
+    p->free_list = NULL;
+    atomic_init(&p->stopping, false);
+    p->closed = false;
+    int rc = pthread_mutex_init(&p->mutex, NULL);
+    assert(!rc);
+
+    p->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (p->epfd < 0) {
+        fprintf(stderr, "failed to create epoll instance in poller_new()\n");
+        exit(1);
+    }
+
+    // accept in a loop until the backlog is empty
+    int flags = fcntl(sock->fd, F_GETFL);
+    fcntl(sock->fd, F_SETFL, flags | O_NONBLOCK);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &listener_tag };
+    rc = epoll_ctl(p->epfd, EPOLL_CTL_ADD, sock->fd, &ev);
+    assert(!rc);
+
+    p->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (p->evfd < 0) {
+        fprintf(stderr, "failed to create eventfd in poller_new()\n");
+        exit(1);
+    }
+    ev.data.ptr = &resume_tag;
+    rc = epoll_ctl(p->epfd, EPOLL_CTL_ADD, p->evfd, &ev);
+    assert(!rc);
+    (void) rc;
+    return p;
+}
+
+static pending_list *list_of(poller_t *p, pending *c) {
+    return c->ready ? &p->ready : c->idle ? &p->idle : &p->fresh;
+}
+
+// Append c with a deadline timeout seconds from now (for a ready
+// connection, 0: the deadline is when it was parsed).
+static void append_pending(poller_t *p, pending *c, int timeout) {
+    pending_list *l = list_of(p, c);
+    clock_gettime(CLOCK_MONOTONIC, &c->deadline);
+    c->deadline.tv_sec += timeout;
+
+    // deadlines are non-decreasing along the list
+    c->next = NULL;
+    c->prev = l->tail;
+    if (l->tail) {
+        l->tail->next = c;
+    } else {
+        l->head = c;
+    }
+    l->tail = c;
+}
+
+static void unlink_pending(poller_t *p, pending *c) {
+    pending_list *l = list_of(p, c);
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        l->head = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    } else {
+        l->tail = c->prev;
+    }
+}
+
+// Take an unused pending, or allocate one. Returns NULL if it can't.
+static pending *new_pending(poller_t *p) {
+    pending *c = p->free_list;
+    if (c != NULL) {
+        p->free_list = c->next;
+        return c;
+    }
+    return malloc(sizeof(pending));
+}
+
+static void free_pending(poller_t *p, pending *c) {
+    c->next = p->free_list;
+    p->free_list = c;
+}
+
+static void free_all(pending *c) {
+    while (c != NULL) {
+        pending *next = c->next;
+        free(c);
+        c = next;
+    }
+}
+
+static void close_pending(poller_t *p, pending *c) {
+    conn_delete(&c->conn);
+    close(c->fd);
+    free_pending(p, c);
+}
+
+// Start watching c, which is not on any list yet. Returns false if it
+// can't be watched, in which case it was closed.
+static bool watch_pending(poller_t *p, pending *c) {
+    append_pending(p, c, c->idle ? p->idle_timeout : p->timeout);
+
+    // edge triggered: an already-readable socket reports right away
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP | EPOLLET, .data.ptr = c };
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        unlink_pending(p, c);
+        close_pending(p, c);
+        return false;
+    }
+    return true;
+}
+
+// Milliseconds from t to now.
+static int ms_since(struct timespec *t, struct timespec *now) {
+    return (int) ((now->tv_sec - t->tv_sec) * 1000 + (now->tv_nsec - t->tv_nsec) / 1000000);
+}
+
+// Offer the ready connections to the workers, oldest first, a batch at
+// a time. dispatch never blocks: the ones that it doesn't take (the
+// workers have no room) stay ready and are offered again on the next
+// round, so a full queue never stops the loop from accepting, reading
+// and timing out other connections.
+static void dispatch_ready(poller_t *p) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pending *c = p->ready.head;
+    while (c != NULL) {
+        pending *batch[MAX_BATCH];
+        conn_t *conns[MAX_BATCH];
+        int waited[MAX_BATCH];
+        int n = 0;
+        for (; c != NULL && n < MAX_BATCH; c = c->next) {
+            batch[n] = c;
+            conns[n] = c->conn;
+            waited[n] = ms_since(&c->deadline, &now);
+            n++;
+        }
+        if (p->dispatch(conns, waited, n) == 0) {
+            return;
+        }
+        for (int i = 0; i < n; i++) {
+            if (conns[i] == NULL) {
+                unlink_pending(p, batch[i]);
+                free_pending(p, batch[i]);
+            }
+        }
+    }
+}
+
+// Stop watching c, and either answer it (when res is not NULL) or add
+// it to the ready connections for the workers.
+static void finish_pending(poller_t *p, pending *c, const Response_t *res) {
+    epoll_ctl(p->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    unlink_pending(p, c);
+
+    if (res != NULL) {
+        if (conn_get_count(c->conn) > 0) {
+            conn_set_last(c->conn); // tell a kept-alive client why it's closed
+        }
+        conn_send_response(c->conn, res);
+        metrics_response(p->metrics, METHOD_OTHER, response_get_code(res));
+        close_pending(p, c);
+    } else {
+        c->ready = true;
+        append_pending(p, c, 0);
+    }
+}
+
+// Stop watching c and close it without a response.
+static void drop_pending(poller_t *p, pending *c) {
+    epoll_ctl(p->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    unlink_pending(p, c);
+    close_pending(p, c);
+}
+
+void poller_delete(poller_t **p) {
+    if (p != NULL && *p != NULL) {
+        pending_list *lists[3] = { &(*p)->fresh, &(*p)->idle, &(*p)->ready };
+        for (int i = 0; i < 3; i++) {
+            while (lists[i]->head != NULL) {
+                pending *c = lists[i]->head;
+                unlink_pending(*p, c);
+                close_pending(*p, c);
+            }
+        }
+        while ((*p)->resumed != NULL) {
+            pending *c = (*p)->resumed;
+            (*p)->resumed = c->next;
+            close_pending(*p, c);
+        }
+        free_all((*p)->spare);
+        free_all((*p)->free_list);
+        pthread_mutex_destroy(&(*p)->mutex);
+        close((*p)->evfd);
+        close((*p)->epfd);
+        free(*p);
+        *p = NULL;
+    }
+}
+
+void poller_resume(poller_t *p, conn_t *conn) {
+    pthread_mutex_lock(&p->mutex);
+    pending *c = p->spare;
+    if (c != NULL) {
+        p->spare = c->next;
+    } else {
+        c = malloc(sizeof(pending));
+        if (c == NULL) {
+            pthread_mutex_unlock(&p->mutex);
+            close(conn_get_fd(conn));
+            conn_delete(&conn);
+            return;
+        }
+    }
+    c->conn = conn;
+    c->fd = conn_get_fd(conn);
+    c->idle = conn_idle(conn);
+    c->ready = false;
+    c->next = p->resumed;
+    p->resumed = c;
+    pthread_mutex_unlock(&p->mutex);
+
+    uint64_t one = 1;
+    ssize_t rc = write(p->evfd, &one, sizeof(one));
+    (void) rc; // the counter can't overflow from ones
+}
+
+// Watch every connection that the workers handed back.
+static void add_resumed(poller_t *p) {
+    uint64_t count;
+    ssize_t rc = read(p->evfd, &count, sizeof(count));
+    (void) rc;
+
+    // the loop's unused pendings go to the workers in the same critical
+    // section
+    pending *spare = p->free_list;
+    pending *last = spare;
+    while (last != NULL && last->next != NULL) {
+        last = last->next;
+    }
+    p->free_list = NULL;
+
+    pthread_mutex_lock(&p->mutex);
+    pending *c = p->resumed;
+    p->resumed = NULL;
+    if (last != NULL) {
+        last->next = p->spare;
+        p->spare = spare;
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    while (c != NULL) {
+        pending *next = c->next;
+        watch_pending(p, c);
+        c = next;
+    }
+}
+
+static void handle_readable(poller_t *p, pending *c);
+
+static void accept_all(poller_t *p) {
+    while (1) {
+        int connfd = listener_accept(p->sock);
+        if (connfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                debug("accept: %d", errno);
+            }
+            return;
+        }
+
+        pending *c = new_pending(p);
+        if (c == NULL) {
+            close(connfd);
+            continue;
+        }
+        // a response's last segment must not wait for the ACK of the
+        // one before it on a kept-alive connection (responses are
+        // already written in as few calls as possible)
+        int one = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        metrics_connection(p->metrics);
+        c->conn = conn_new(connfd);
+        c->fd = connfd;
+        c->idle = false;
+        c->ready = false;
+        // the request is usually there already: read it now instead of
+        // after another epoll_wait
+        if (watch_pending(p, c)) {
+            handle_readable(p, c);
+        }
+    }
+}
+
+void poller_stop(poller_t *p) {
+    atomic_store(&p->stopping, true);
+    uint64_t one = 1;
+    ssize_t rc = write(p->evfd, &one, sizeof(one));
+    (void) rc;
+}
+
+// Stop taking new connections: the ones that the kernel already
+// accepted are taken in (and served), then the listener is closed so
+// new ones are refused instead of waiting in its backlog.
+static void close_listener(poller_t *p) {
+    accept_all(p);
+    epoll_ctl(p->epfd, EPOLL_CTL_DEL, p->sock->fd, NULL);
+    close(p->sock->fd);
+    p->closed = true;
+}
+
+// Milliseconds until the deadline of c, or -1 if c is NULL.
+static int ms_until(pending *c, struct timespec *now) {
+    if (c == NULL) {
+        return -1;
+    }
+    long ms = (c->deadline.tv_sec - now->tv_sec) * 1000
+              + (c->deadline.tv_nsec - now->tv_nsec) / 1000000;
+    return ms < 0 ? 0 : (int) ms + 1;
+}
+
+// Milliseconds until the earliest deadline (or until ready connections
+// are offered again), or -1 if nothing is pending.
+static int next_timeout(poller_t *p) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int fresh = ms_until(p->fresh.head, &now);
+    int idle = ms_until(p->idle.head, &now);
+    int ms = fresh;
+    if (fresh < 0 || (idle >= 0 && idle < fresh)) {
+        ms = idle;
+    }
+    if (p->ready.head != NULL && (ms < 0 || ms > DISPATCH_RETRY)) {
+        ms = DISPATCH_RETRY;
+    }
+    return ms;
+}
+
+static bool expired(pending *c, struct timespec *now) {
+    return c != NULL
+           && (c->deadline.tv_sec < now->tv_sec
+               || (c->deadline.tv_sec == now->tv_sec && c->deadline.tv_nsec <= now->tv_nsec));
+}
+
+// Answer every connection whose deadline for a request has passed
+// with 400, and quietly close idle kept-alive connections.
+static void expire(poller_t *p) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (expired(p->fresh.head, &now)) {
+        debug("request timed out on fd %d", p->fresh.head->fd);
+        finish_pending(p, p->fresh.head, &RESPONSE_BAD_REQUEST);
+    }
+    while (expired(p->idle.head, &now)) {
+        debug("idle connection timed out on fd %d", p->idle.head->fd);
+        drop_pending(p, p->idle.head);
+    }
+}
+
+static void handle_readable(poller_t *p, pending *c) {
+    const Response_t *res = NULL;
+    uint64_t start = metrics_now(p->metrics);
+    switch (conn_try_parse(c->conn, &res)) {
+    case PARSE_DONE:
+        metrics_record(p->metrics, PHASE_PARSE, start);
+        finish_pending(p, c, res);
+        break;
+    case PARSE_CLOSED: drop_pending(p, c); break;
+    case PARSE_AGAIN:
+        if (c->idle && !conn_idle(c->conn)) {
+            // a request has started: it gets the header timeout now
+            unlink_pending(p, c);
+            c->idle = false;
+            append_pending(p, c, p->timeout);
+        }
+        break;
+    }
+}
+
+void poller_run(poller_t *p) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(p->epfd, events, MAX_EVENTS, next_timeout(p));
+        if (n < 0 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed in poller_run()\n");
+            exit(1);
+        }
+
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == &listener_tag) {
+                accept_all(p);
+            } else if (events[i].data.ptr == &resume_tag) {
+                add_resumed(p);
+            } else {
+                handle_readable(p, events[i].data.ptr);
+            }
+        }
+        dispatch_ready(p);
+
+        expire(p);
+
+        if (atomic_load(&p->stopping)) {
+            if (!p->closed) {
+                close_listener(p);
+                dispatch_ready(p);
+            }
+            // nothing is in flight on an idle connection
+            while (p->idle.head != NULL) {
+                drop_pending(p, p->idle.head);
+            }
+            if (p->fresh.head == NULL && p->ready.head == NULL) {
+                return;
+            }
+        }
+    }
+}
@@ -0,0 +1,90 @@
+/**
+ * @File poller.h
+ *
+ * An epoll-based front end for the server. The poller accepts new
+ * connections and reads their requests without blocking; only
+ * connections whose request line and headers have fully arrived are
+ * handed to the worker pool.
+ */
+
+#pragma once
+
+#include "asgn2_helper_funcs.h"
+#include "connection.h"
+#include "metrics.h"
+
+/** @struct poller_t
+ *
+ *  @brief This typedef renames the struct poller.
+ */
+typedef struct poller poller_t;
+
+/** @brief A function that hands parsed connections to the workers, a
+ *         batch at a time, oldest first.  It must not block: it sets
+ *         each connection that it takes (hands off, or answers itself)
+ *         to NULL, and the poller keeps the others and offers them
+ *         again about a millisecond later (e.g., while the workers are
+ *         saturated).  waited_ms[i] is how long conns[i] has waited
+ *         since its request was parsed.  Returns the number taken.
+ */
+typedef int (*dispatch_fn)(conn_t **conns, const int *waited_ms, int n);
+
+/** @brief Dynamically allocates and initializes a new poller that
+ *         accepts connections from sock and passes parsed connections
+ *         to dispatch.  Connections are accepted until the backlog is
+ *         empty, and each one's request is read right away, since it
+ *         has usually arrived with the connection.
+ *
+ *  @param sock the listener socket.  It is switched to non-blocking
+ *         mode, and closed when the poller is stopped.
+ *
+ *  @param dispatch the function that receives parsed connections.
+ *
+ *  @param timeout the number of seconds a client has to send its full
+ *         request header before it is answered with 400 and closed.
+ *
+ *  @param idle_timeout the number of seconds a kept-alive connection
+ *         may wait for its next request before it is closed.
+ *
+ *  @param metrics where connections, parse times and the poller's own
+ *         error responses are counted, or NULL.
+ *
+ *  @return a pointer to a new poller_t
+ */
+poller_t *poller_new(Listener_Socket *sock, dispatch_fn dispatch, int timeout, int idle_timeout,
+    metrics_t *metrics);
+
+/** @brief Delete a poller, closing any connections that are still
+ *         waiting on their requests.
+ *
+ *  @param p the poller to be deleted.  *p is set to NULL.
+ */
+void poller_delete(poller_t **p);
+
+/** @brief Hand a kept-alive connection back to the poller to wait for
+ *         its next request.  Safe to call from any thread.
+ *
+ *  @param p the poller.
+ *
+ *  @param conn the connection, which the poller now owns.
+ */
+void poller_resume(poller_t *p, conn_t *conn);
+
+/** @brief Run the event loop until the poller is stopped and every
+ *         connection whose request had started arriving has been handed
+ *         to the workers (or has timed out).
+ *
+ *  @param p the poller to run.
+ */
+void poller_run(poller_t *p);
+
+/** @brief Stop a poller: it accepts the connections that are already
+ *         waiting in the listener's backlog, closes the listener, closes
+ *         idle kept-alive connections, and returns from poller_run once
+ *         no request is still arriving.  Connections that are resumed
+ *         afterwards are closed if idle, or by poller_delete.  Safe to
+ *         call from any thread (but not from a signal handler).
+ *
+ *  @param p the poller.
+ */
+void poller_stop(poller_t *p);
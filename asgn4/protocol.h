@@ -0,0 +1,31 @@
+#pragma once
+
+// Protocol constants shared by the connection and buffered socket
+// layers.
+
+#define HTTP_VERSION "HTTP/1.1"
+
+// The longest request line + header block that we accept.
+#define MAX_HEADER_LEN 2048
+
+////// Request line: METHOD /URI HTTP/x.y, where METHOD is letters and
+////// URI is [a-zA-Z0-9.-]
+#define MAX_METHOD_LEN 8
+#define MAX_URI_LEN    63
+
+////// Header field: KEY: VALUE, where KEY is [a-zA-Z0-9.-] and VALUE is
+////// printable characters
+#define MAX_KEY_LEN   128
+#define MAX_VALUE_LEN 128
+
+// Headers that we save when parsing a request.
+//   X(short name, header name, conn_t field)
+#define SAVE_HEADERS                                                                               \
+    X("cl", "Content-Length", cl)                                                                  \
+    X("rid", "Request-Id", rid)                                                                    \
+    X("conn", "Connection", connection)                                                            \
+    X("range", "Range", range)                                                                     \
+    X("te", "Transfer-Encoding", te)                                                               \
+    X("inm", "If-None-Match", if_none_match)                                                       \
+    X("ims", "If-Modified-Since", if_modified_since)                                               \
+    X("ir", "If-Range", if_range)
@@ -4,7 +4,9 @@
 #include <stdint.h>
 #include <sys/types.h>
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "queue.h"
@@ -18,6 +20,8 @@ typedef struct queue {
     pthread_mutex_t mutex;
     pthread_cond_t cv_pop;
     pthread_cond_t cv_push;
+    int pop_waiters; // threads waiting in cv_push
+    int push_waiters; // threads waiting in cv_pop
 } queue;
 
 /** @brief Dynamically allocates and initializes a new queue with a
@@ -41,14 +45,21 @@ queue_t *queue_new(int size) {
     int rc;
     rc = pthread_mutex_init(&(Q->mutex), NULL);
     assert(!rc);
-    rc = pthread_cond_init(&(Q->cv_pop), NULL);
+    // timed waits measure their deadlines on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    rc = pthread_cond_init(&(Q->cv_pop), &attr);
     assert(!rc);
-    rc = pthread_cond_init(&(Q->cv_push), NULL);
+    rc = pthread_cond_init(&(Q->cv_push), &attr);
     assert(!rc);
+    pthread_condattr_destroy(&attr);
     Q->length = 0;
     Q->size = size;
     Q->front = 0;
     Q->back = -1;
+    Q->pop_waiters = 0;
+    Q->push_waiters = 0;
     return Q;
 }
 
@@ -93,7 +104,9 @@ bool queue_push(queue_t *q, void *elem) {
     pthread_mutex_lock(&(q->mutex));
     while (q->length == q->size) {
         //fprintf(stdout, "waiting since queu is full....\n");
+        q->push_waiters++;
         pthread_cond_wait(&(q->cv_pop), &(q->mutex));
+        q->push_waiters--;
     }
     //fprintf(stdout, "pushing....\n");
     q->back = ((q->back) + 1) % (q->size);
@@ -121,7 +134,9 @@ bool queue_pop(queue_t *q, void **elem) {
     pthread_mutex_lock(&(q->mutex));
     while (q->length == 0) {
         // fprintf(stdout, "waiting since queue is empty....\n");
+        q->pop_waiters++;
         pthread_cond_wait(&(q->cv_push), &(q->mutex));
+        q->pop_waiters--;
     }
     //fprintf(stdout, "poping....\n");
     *elem = q->elem[q->front];
@@ -136,3 +151,231 @@ bool queue_pop(queue_t *q, void **elem) {
     pthread_cond_signal(&(q->cv_pop));
     return true;
 }
+
+// The monotonic time timeout_ms from now.
+static struct timespec deadline_in(int timeout_ms) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    t.tv_sec += timeout_ms / 1000;
+    t.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+    if (t.tv_nsec >= 1000000000) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+    return t;
+}
+
+/** @brief push an element onto a queue unless it is full.
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem the element to add to the queue.
+ *
+ *  @return true if elem was pushed, false otherwise.
+ */
+bool queue_try_push(queue_t *q, void *elem) {
+    return queue_timed_push(q, elem, 0);
+}
+
+/** @brief push an element onto a queue, waiting at most timeout_ms for
+ *         room if it is full.
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem the element to add to the queue.
+ *
+ *  @param timeout_ms the most milliseconds to wait.
+ *
+ *  @return true if elem was pushed, false otherwise.
+ */
+bool queue_timed_push(queue_t *q, void *elem, int timeout_ms) {
+    if (q == NULL || elem == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&(q->mutex));
+    if (q->length == q->size && timeout_ms > 0) {
+        struct timespec deadline = deadline_in(timeout_ms);
+        int rc = 0;
+        while (q->length == q->size && rc != ETIMEDOUT) {
+            q->push_waiters++;
+            rc = pthread_cond_timedwait(&(q->cv_pop), &(q->mutex), &deadline);
+            q->push_waiters--;
+        }
+    }
+    if (q->length == q->size) {
+        pthread_mutex_unlock(&(q->mutex));
+        return false;
+    }
+    q->back = ((q->back) + 1) % (q->size);
+    q->elem[q->back] = elem;
+    q->length++;
+    pthread_mutex_unlock(&(q->mutex));
+    pthread_cond_signal(&(q->cv_push));
+    return true;
+}
+
+/** @brief pop an element from a queue, waiting at most timeout_ms for
+ *         one if it is empty.
+ *
+ *  @param q the queue to pop an element from.
+ *
+ *  @param elem a place to assign the popped element.
+ *
+ *  @param timeout_ms the most milliseconds to wait.
+ *
+ *  @return true if an element was popped, false otherwise.
+ */
+bool queue_timed_pop(queue_t *q, void **elem, int timeout_ms) {
+    if (q == NULL || elem == NULL) {
+        return false;
+    }
+    pthread_mutex_lock(&(q->mutex));
+    if (q->length == 0 && timeout_ms > 0) {
+        struct timespec deadline = deadline_in(timeout_ms);
+        int rc = 0;
+        while (q->length == 0 && rc != ETIMEDOUT) {
+            q->pop_waiters++;
+            rc = pthread_cond_timedwait(&(q->cv_push), &(q->mutex), &deadline);
+            q->pop_waiters--;
+        }
+    }
+    if (q->length == 0) {
+        pthread_mutex_unlock(&(q->mutex));
+        return false;
+    }
+    *elem = q->elem[q->front];
+    q->front = ((q->front) + 1) % (q->size);
+    q->length--;
+    pthread_mutex_unlock(&(q->mutex));
+    pthread_cond_signal(&(q->cv_pop));
+    return true;
+}
+
+// The number of threads to wake for a batch of n elements: one per
+// element, but no more than are waiting (read with the mutex held), so
+// a batch neither wakes one thread for all of it nor every thread.
+static int wakeups(int n, int waiters) {
+    return n < waiters ? n : waiters;
+}
+
+static void signal_n(pthread_cond_t *cv, int n) {
+    for (int i = 0; i < n; i++) {
+        pthread_cond_signal(cv);
+    }
+}
+
+/** @brief push n elements onto a queue, in order, taking the queue's
+ *         lock once for as many of them as fit at a time.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue.
+ *
+ *  @param n the number of elements.
+ *
+ *  @return A bool indicating success or failure.
+ */
+bool queue_push_many(queue_t *q, void **elems, int n) {
+    if (q == NULL || elems == NULL) {
+        return false;
+    }
+    int done = 0;
+    while (done < n) {
+        pthread_mutex_lock(&(q->mutex));
+        while (q->length == q->size) {
+            q->push_waiters++;
+            pthread_cond_wait(&(q->cv_pop), &(q->mutex));
+            q->push_waiters--;
+        }
+        int k = 0;
+        while (done + k < n && q->length < q->size) {
+            q->back = ((q->back) + 1) % (q->size);
+            q->elem[q->back] = elems[done + k];
+            q->length++;
+            k++;
+        }
+        int wake = wakeups(k, q->pop_waiters);
+        pthread_mutex_unlock(&(q->mutex));
+        signal_n(&(q->cv_push), wake);
+        done += k;
+    }
+    return true;
+}
+
+/** @brief push as many of n elements onto a queue as fit, without
+ *         blocking.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue.
+ *
+ *  @param n the number of elements.
+ *
+ *  @return the number of elements pushed.
+ */
+int queue_try_push_many(queue_t *q, void **elems, int n) {
+    if (q == NULL || elems == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&(q->mutex));
+    int k = 0;
+    while (k < n && q->length < q->size) {
+        q->back = ((q->back) + 1) % (q->size);
+        q->elem[q->back] = elems[k];
+        q->length++;
+        k++;
+    }
+    int wake = wakeups(k, q->pop_waiters);
+    pthread_mutex_unlock(&(q->mutex));
+    signal_n(&(q->cv_push), wake);
+    return k;
+}
+
+/** @brief pop up to max elements from a queue at once.
+ *
+ *  @param q the queue to pop the elements from.
+ *
+ *  @param elems a place to assign the popped elements.
+ *
+ *  @param max the most elements to pop.
+ *
+ *  @return the number of elements popped, or 0 on failure.
+ */
+int queue_pop_many(queue_t *q, void **elems, int max) {
+    if (q == NULL || elems == NULL || max <= 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&(q->mutex));
+    while (q->length == 0) {
+        q->pop_waiters++;
+        pthread_cond_wait(&(q->cv_push), &(q->mutex));
+        q->pop_waiters--;
+    }
+    int k = 0;
+    while (k < max && q->length > 0) {
+        elems[k++] = q->elem[q->front];
+        q->front = ((q->front) + 1) % (q->size);
+        q->length--;
+    }
+    int wake = wakeups(k, q->push_waiters);
+    pthread_mutex_unlock(&(q->mutex));
+    signal_n(&(q->cv_pop), wake);
+    return k;
+}
+
+/** @brief the number of elements in a queue, for monitoring.  It may
+ *         be out of date as soon as it is returned.
+ *
+ *  @param q the queue.
+ *
+ *  @return the number of elements, or 0 if q is NULL.
+ */
+int queue_length(queue_t *q) {
+    if (q == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&(q->mutex));
+    int length = q->length;
+    pthread_mutex_unlock(&(q->mutex));
+    return length;
+}
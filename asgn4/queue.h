@@ -58,3 +58,96 @@ bool queue_push(queue_t *q, void *elem);
  *          should succeed unless the q parameter is NULL.
  */
 bool queue_pop(queue_t *q, void **elem);
+
+/** @brief push an element onto a queue unless it is full.
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem the element to add to the queue.
+ *
+ *  @return true if elem was pushed, false if the queue is full (or q or
+ *          elem is NULL).
+ */
+bool queue_try_push(queue_t *q, void *elem);
+
+/** @brief push an element onto a queue, waiting at most timeout_ms for
+ *         room if it is full.
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem the element to add to the queue.
+ *
+ *  @param timeout_ms the most milliseconds to wait (0 does not wait).
+ *
+ *  @return true if elem was pushed, false if the queue stayed full until
+ *          the timeout (or q or elem is NULL).
+ */
+bool queue_timed_push(queue_t *q, void *elem, int timeout_ms);
+
+/** @brief pop an element from a queue, waiting at most timeout_ms for
+ *         one if it is empty.
+ *
+ *  @param q the queue to pop an element from.
+ *
+ *  @param elem a place to assign the popped element.
+ *
+ *  @param timeout_ms the most milliseconds to wait (0 does not wait).
+ *
+ *  @return true if an element was popped, false if the queue stayed
+ *          empty until the timeout (or q or elem is NULL).
+ */
+bool queue_timed_pop(queue_t *q, void **elem, int timeout_ms);
+
+/** @brief push n elements onto a queue, in order, taking the queue's
+ *         lock (or claiming its slots) once for as many of them as fit
+ *         at a time, and waking up to one popper per element.  Blocks
+ *         while the queue is full.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue, none of them NULL.
+ *
+ *  @param n the number of elements.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless q or elems is NULL.
+ */
+bool queue_push_many(queue_t *q, void **elems, int n);
+
+/** @brief push as many of n elements onto a queue as fit, in order,
+ *         without blocking, like queue_push_many.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue, none of them NULL.
+ *
+ *  @param n the number of elements.
+ *
+ *  @return the number of elements pushed (the first ones of elems), or
+ *          0 if the queue is full (or q or elems is NULL).
+ */
+int queue_try_push_many(queue_t *q, void **elems, int n);
+
+/** @brief pop up to max elements from a queue at once.  Blocks while
+ *         the queue is empty, then takes as many of the elements that
+ *         are in it as it can without waiting again.
+ *
+ *  @param q the queue to pop the elements from.
+ *
+ *  @param elems a place to assign the popped elements, in order.
+ *
+ *  @param max the most elements to pop.
+ *
+ *  @return the number of elements popped (at least 1), or 0 if q or
+ *          elems is NULL or max is not positive.
+ */
+int queue_pop_many(queue_t *q, void **elems, int max);
+
+/** @brief the number of elements in a queue, for monitoring.  It may
+ *         be out of date as soon as it is returned.
+ *
+ *  @param q the queue.
+ *
+ *  @return the number of elements, or 0 if q is NULL.
+ */
+int queue_length(queue_t *q);
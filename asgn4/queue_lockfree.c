@@ -0,0 +1,495 @@
+#include <linux/futex.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "queue.h"
+
+// A bounded lock-free MPMC queue (a ring of sequence-numbered cells).
+//
+// Cell i starts with seq = i.  A pusher that claims position pos (by
+// advancing tail) may write its cell when seq == pos, and then
+// publishes it with seq = pos + 1.  A popper that claims position pos
+// (by advancing head) may read its cell when seq == pos + 1, and then
+// frees it for the next lap with seq = pos + size.
+//
+// Threads only block (on a futex) when the queue is empty or full.
+
+#define CACHE_LINE 64
+
+typedef struct cell {
+    _Atomic size_t seq;
+    void *elem;
+} cell;
+
+typedef struct queue {
+    size_t size; // capacity of the queue
+    cell *cells; // the elements
+
+    alignas(CACHE_LINE) _Atomic size_t head; // next position to pop
+    alignas(CACHE_LINE) _Atomic size_t tail; // next position to push
+
+    // futex words that are bumped after a push (pop) when somebody is
+    // waiting for one, and the number of threads waiting
+    alignas(CACHE_LINE) _Atomic uint32_t pushed;
+    _Atomic uint32_t pop_waiters;
+    alignas(CACHE_LINE) _Atomic uint32_t popped;
+    _Atomic uint32_t push_waiters;
+} queue;
+
+// Sleep while *word == val, for at most timeout (forever if NULL).
+static void futex_wait(_Atomic uint32_t *word, uint32_t val, const struct timespec *timeout) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static void futex_wake(_Atomic uint32_t *word, int n) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/** @brief Dynamically allocates and initializes a new queue with a
+ *         maximum size, size
+ *
+ *  @param size the maximum size of the queue
+ *
+ *  @return a pointer to a new queue_t
+ */
+queue_t *queue_new(int size) {
+    // with one cell, a full cell's seq (pos + 1) is what a pusher at
+    // pos + 1 takes for free, so it would be overwritten
+    if (size < 2) {
+        size = 2;
+    }
+    size_t bytes = (sizeof(queue) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    queue_t *Q = aligned_alloc(CACHE_LINE, bytes);
+    if (Q == NULL) {
+        fprintf(stderr, "failed to create new queue in queue_new()\n");
+        exit(1);
+    }
+    Q->cells = calloc(size, sizeof(cell));
+    if (Q->cells == NULL) {
+        fprintf(stderr, "failed to allocte for cells in queue_new()\n");
+        exit(1);
+    }
+    for (int i = 0; i < size; i++) {
+        atomic_init(&Q->cells[i].seq, i);
+    }
+    Q->size = size;
+    atomic_init(&Q->head, 0);
+    atomic_init(&Q->tail, 0);
+    atomic_init(&Q->pushed, 0);
+    atomic_init(&Q->pop_waiters, 0);
+    atomic_init(&Q->popped, 0);
+    atomic_init(&Q->push_waiters, 0);
+    return Q;
+}
+
+/** @brief Delete your queue and free all of its memory.
+ *
+ *  @param q the queue to be deleted.  Note, you should assign the
+ *  passed in pointer to NULL when returning (i.e., you should set
+ *  *q = NULL after deallocation).
+ *
+ */
+void queue_delete(queue_t **q) {
+    if (q != NULL && *q != NULL) {
+        free((*q)->cells);
+        free(*q);
+        *q = NULL;
+    }
+}
+
+// Push without blocking; returns false if the queue is full.
+static bool try_push(queue_t *q, void *elem) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (1) {
+        cell *c = &q->cells[pos % q->size];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                c->elem = elem;
+                atomic_store_explicit(&c->seq, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+// Pop without blocking; returns false if the queue is empty.
+static bool try_pop(queue_t *q, void **elem) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (1) {
+        cell *c = &q->cells[pos % q->size];
+        size_t seq = atomic_load_explicit(&c->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &q->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *elem = c->elem;
+                atomic_store_explicit(&c->seq, pos + q->size, memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+// Claim up to n consecutive cells that are ready for (ready_seq = 0)
+// pushers or (1) poppers, starting at *end, with one CAS; returns the
+// first position claimed, and how many were in *n (0 if none were
+// ready).  A cell whose seq says it's ready can only be taken by the
+// thread that moves *end past it, so checking them before the CAS is
+// enough.
+static size_t claim(queue_t *q, _Atomic size_t *end, size_t ready_seq, int *n) {
+    size_t pos = atomic_load_explicit(end, memory_order_relaxed);
+    while (1) {
+        int k = 0;
+        bool moved = false;
+        while (k < *n) {
+            size_t seq = atomic_load_explicit(&q->cells[(pos + k) % q->size].seq, memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) (pos + k + ready_seq);
+            if (diff != 0) {
+                // behind: full (or empty); ahead: *end moved past pos
+                moved = k == 0 && diff > 0;
+                break;
+            }
+            k++;
+        }
+        if (moved) {
+            pos = atomic_load_explicit(end, memory_order_relaxed);
+        } else if (k == 0) {
+            *n = 0;
+            return pos;
+        } else if (atomic_compare_exchange_weak_explicit(
+                       end, &pos, pos + k, memory_order_relaxed, memory_order_relaxed)) {
+            *n = k;
+            return pos;
+        }
+    }
+}
+
+// Push as many of the n elements as fit without blocking; returns how
+// many were pushed.
+static int try_push_many(queue_t *q, void **elems, int n) {
+    size_t pos = claim(q, &q->tail, 0, &n);
+    for (int i = 0; i < n; i++) {
+        cell *c = &q->cells[(pos + i) % q->size];
+        c->elem = elems[i];
+        atomic_store_explicit(&c->seq, pos + i + 1, memory_order_release);
+    }
+    return n;
+}
+
+// Pop up to max elements without blocking; returns how many were popped.
+static int try_pop_many(queue_t *q, void **elems, int max) {
+    size_t pos = claim(q, &q->head, 1, &max);
+    for (int i = 0; i < max; i++) {
+        cell *c = &q->cells[(pos + i) % q->size];
+        elems[i] = c->elem;
+        atomic_store_explicit(&c->seq, pos + i + q->size, memory_order_release);
+    }
+    return max;
+}
+
+// Wake up to n waiters on word, if there are any.  The fence orders the
+// push/pop that was just made before the read of waiters; waiters
+// re-check the queue after announcing themselves, so one of the two
+// sides always sees the other.
+static void notify(_Atomic uint32_t *word, _Atomic uint32_t *waiters, int n) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(waiters) > 0) {
+        atomic_fetch_add(word, 1);
+        futex_wake(word, n);
+    }
+}
+
+/** @brief push an element onto a queue
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem th element to add to the queue
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q parameter is NULL.
+ */
+bool queue_push(queue_t *q, void *elem) {
+    if (q == NULL || elem == NULL) {
+        return false;
+    }
+    while (!try_push(q, elem)) {
+        // the queue is full: sleep until a pop happens
+        uint32_t v = atomic_load(&q->popped);
+        atomic_fetch_add(&q->push_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool done = try_push(q, elem);
+        if (!done) {
+            futex_wait(&q->popped, v, NULL);
+        }
+        atomic_fetch_sub(&q->push_waiters, 1);
+        if (done) {
+            break;
+        }
+    }
+    notify(&q->pushed, &q->pop_waiters, 1);
+    return true;
+}
+
+/** @brief pop an element from a queue.
+ *
+ *  @param q the queue to pop an element from.
+ *
+ *  @param elem a place to assign the poped element.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless the q parameter is NULL.
+ */
+bool queue_pop(queue_t *q, void **elem) {
+    if (q == NULL || elem == NULL) {
+        return false;
+    }
+    while (!try_pop(q, elem)) {
+        // the queue is empty: sleep until a push happens
+        uint32_t v = atomic_load(&q->pushed);
+        atomic_fetch_add(&q->pop_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool done = try_pop(q, elem);
+        if (!done) {
+            futex_wait(&q->pushed, v, NULL);
+        }
+        atomic_fetch_sub(&q->pop_waiters, 1);
+        if (done) {
+            break;
+        }
+    }
+    notify(&q->popped, &q->push_waiters, 1);
+    return true;
+}
+
+/** @brief push an element onto a queue unless it is full.
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem the element to add to the queue.
+ *
+ *  @return true if elem was pushed, false otherwise.
+ */
+bool queue_try_push(queue_t *q, void *elem) {
+    if (q == NULL || elem == NULL || !try_push(q, elem)) {
+        return false;
+    }
+    notify(&q->pushed, &q->pop_waiters, 1);
+    return true;
+}
+
+/** @brief push an element onto a queue, waiting at most timeout_ms for
+ *         room if it is full.
+ *
+ *  @param q the queue to push an element into.
+ *
+ *  @param elem the element to add to the queue.
+ *
+ *  @param timeout_ms the most milliseconds to wait.
+ *
+ *  @return true if elem was pushed, false otherwise.
+ */
+bool queue_timed_push(queue_t *q, void *elem, int timeout_ms) {
+    if (q == NULL || elem == NULL) {
+        return false;
+    }
+    uint64_t deadline = now_ns() + (uint64_t) (timeout_ms > 0 ? timeout_ms : 0) * 1000000;
+    while (!try_push(q, elem)) {
+        // the queue is full: sleep until a pop happens, or the deadline
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            return false;
+        }
+        struct timespec left = { .tv_sec = (deadline - now) / 1000000000,
+            .tv_nsec = (deadline - now) % 1000000000 };
+        uint32_t v = atomic_load(&q->popped);
+        atomic_fetch_add(&q->push_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool done = try_push(q, elem);
+        if (!done) {
+            futex_wait(&q->popped, v, &left);
+        }
+        atomic_fetch_sub(&q->push_waiters, 1);
+        if (done) {
+            break;
+        }
+    }
+    notify(&q->pushed, &q->pop_waiters, 1);
+    return true;
+}
+
+/** @brief pop an element from a queue, waiting at most timeout_ms for
+ *         one if it is empty.
+ *
+ *  @param q the queue to pop an element from.
+ *
+ *  @param elem a place to assign the popped element.
+ *
+ *  @param timeout_ms the most milliseconds to wait.
+ *
+ *  @return true if an element was popped, false otherwise.
+ */
+bool queue_timed_pop(queue_t *q, void **elem, int timeout_ms) {
+    if (q == NULL || elem == NULL) {
+        return false;
+    }
+    uint64_t deadline = now_ns() + (uint64_t) (timeout_ms > 0 ? timeout_ms : 0) * 1000000;
+    while (!try_pop(q, elem)) {
+        // the queue is empty: sleep until a push happens, or the deadline
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            return false;
+        }
+        struct timespec left = { .tv_sec = (deadline - now) / 1000000000,
+            .tv_nsec = (deadline - now) % 1000000000 };
+        uint32_t v = atomic_load(&q->pushed);
+        atomic_fetch_add(&q->pop_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        bool done = try_pop(q, elem);
+        if (!done) {
+            futex_wait(&q->pushed, v, &left);
+        }
+        atomic_fetch_sub(&q->pop_waiters, 1);
+        if (done) {
+            break;
+        }
+    }
+    notify(&q->popped, &q->push_waiters, 1);
+    return true;
+}
+
+/** @brief push n elements onto a queue, in order, claiming as many
+ *         slots as are free at a time with one CAS.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue.
+ *
+ *  @param n the number of elements.
+ *
+ *  @return A bool indicating success or failure.
+ */
+bool queue_push_many(queue_t *q, void **elems, int n) {
+    if (q == NULL || elems == NULL) {
+        return false;
+    }
+    int done = 0;
+    while (done < n) {
+        int k = try_push_many(q, elems + done, n - done);
+        if (k == 0) {
+            // the queue is full: sleep until a pop happens
+            uint32_t v = atomic_load(&q->popped);
+            atomic_fetch_add(&q->push_waiters, 1);
+            atomic_thread_fence(memory_order_seq_cst);
+            k = try_push_many(q, elems + done, n - done);
+            if (k == 0) {
+                futex_wait(&q->popped, v, NULL);
+            }
+            atomic_fetch_sub(&q->push_waiters, 1);
+        }
+        if (k > 0) {
+            notify(&q->pushed, &q->pop_waiters, k);
+            done += k;
+        }
+    }
+    return true;
+}
+
+/** @brief push as many of n elements onto a queue as fit, without
+ *         blocking, claiming the free slots with one CAS at a time.
+ *
+ *  @param q the queue to push the elements into.
+ *
+ *  @param elems the elements to add to the queue.
+ *
+ *  @param n the number of elements.
+ *
+ *  @return the number of elements pushed.
+ */
+int queue_try_push_many(queue_t *q, void **elems, int n) {
+    if (q == NULL || elems == NULL) {
+        return 0;
+    }
+    int done = 0;
+    int k;
+    while (done < n && (k = try_push_many(q, elems + done, n - done)) > 0) {
+        notify(&q->pushed, &q->pop_waiters, k);
+        done += k;
+    }
+    return done;
+}
+
+/** @brief pop up to max elements from a queue at once, claiming them
+ *         with one CAS.
+ *
+ *  @param q the queue to pop the elements from.
+ *
+ *  @param elems a place to assign the popped elements.
+ *
+ *  @param max the most elements to pop.
+ *
+ *  @return the number of elements popped, or 0 on failure.
+ */
+int queue_pop_many(queue_t *q, void **elems, int max) {
+    if (q == NULL || elems == NULL || max <= 0) {
+        return 0;
+    }
+    int k;
+    while ((k = try_pop_many(q, elems, max)) == 0) {
+        // the queue is empty: sleep until a push happens
+        uint32_t v = atomic_load(&q->pushed);
+        atomic_fetch_add(&q->pop_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        k = try_pop_many(q, elems, max);
+        if (k == 0) {
+            futex_wait(&q->pushed, v, NULL);
+        }
+        atomic_fetch_sub(&q->pop_waiters, 1);
+        if (k > 0) {
+            break;
+        }
+    }
+    notify(&q->popped, &q->push_waiters, k);
+    return k;
+}
+
+/** @brief the number of elements in a queue, for monitoring.  It may
+ *         be out of date as soon as it is returned.
+ *
+ *  @param q the queue.
+ *
+ *  @return the number of elements, or 0 if q is NULL.
+ */
+int queue_length(queue_t *q) {
+    if (q == NULL) {
+        return 0;
+    }
+    // head first: tail can only have moved further since
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return tail > head ? (int) (tail - head) : 0;
+}
@@ -0,0 +1,224 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sched.h"
+
+#define CACHE_LINE 64
+
+// A bounded ring used as a deque.  The owner pops from the front, the
+// dispatcher pushes on the back, and thieves steal from the back.
+// Each deque sits on its own cache lines, so workers that run out of
+// their own deques are the only ones that touch a peer's.
+typedef struct deque {
+    alignas(CACHE_LINE) pthread_mutex_t mutex;
+    int length; // number of elements in the deque
+    int front; // index of the front element
+    void **elem;
+} deque;
+
+typedef struct sched {
+    int workers; // number of deques
+    int capacity; // capacity of each deque
+    deque *deques;
+    _Atomic unsigned int next; // round-robin cursor
+
+    // sleeping: idle workers wait on cv_work, a dispatcher facing full
+    // deques waits on cv_space
+    alignas(CACHE_LINE) pthread_mutex_t mutex;
+    pthread_cond_t cv_work;
+    pthread_cond_t cv_space;
+    _Atomic int idle; // number of workers waiting on cv_work
+    _Atomic int full; // number of dispatchers waiting on cv_space
+} sched;
+
+static bool push_back(deque *d, int capacity, void *elem) {
+    bool ok = false;
+    pthread_mutex_lock(&d->mutex);
+    if (d->length < capacity) {
+        d->elem[(d->front + d->length) % capacity] = elem;
+        d->length++;
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return ok;
+}
+
+static bool pop_front(deque *d, int capacity, void **elem) {
+    bool ok = false;
+    pthread_mutex_lock(&d->mutex);
+    if (d->length > 0) {
+        *elem = d->elem[d->front];
+        d->front = (d->front + 1) % capacity;
+        d->length--;
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return ok;
+}
+
+static bool pop_back(deque *d, int capacity, void **elem) {
+    bool ok = false;
+    pthread_mutex_lock(&d->mutex);
+    if (d->length > 0) {
+        d->length--;
+        *elem = d->elem[(d->front + d->length) % capacity];
+        ok = true;
+    }
+    pthread_mutex_unlock(&d->mutex);
+    return ok;
+}
+
+sched_t *sched_new(int workers, int capacity) {
+    sched_t *s = aligned_alloc(CACHE_LINE, sizeof(sched));
+    if (s == NULL) {
+        fprintf(stderr, "failed to create new scheduler in sched_new()\n");
+        exit(1);
+    }
+    s->deques = aligned_alloc(CACHE_LINE, workers * sizeof(deque));
+    if (s->deques == NULL) {
+        fprintf(stderr, "failed to allocate deques in sched_new()\n");
+        exit(1);
+    }
+
+    int rc;
+    for (int i = 0; i < workers; i++) {
+        deque *d = &s->deques[i];
+        rc = pthread_mutex_init(&d->mutex, NULL);
+        assert(!rc);
+        d->length = 0;
+        d->front = 0;
+        d->elem = calloc(capacity, sizeof(void *));
+        if (d->elem == NULL) {
+            fprintf(stderr, "failed to allocate deque in sched_new()\n");
+            exit(1);
+        }
+    }
+
+    rc = pthread_mutex_init(&s->mutex, NULL);
+    assert(!rc);
+    rc = pthread_cond_init(&s->cv_work, NULL);
+    assert(!rc);
+    rc = pthread_cond_init(&s->cv_space, NULL);
+    assert(!rc);
+    (void) rc;
+
+    s->workers = workers;
+    s->capacity = capacity;
+    atomic_init(&s->next, 0);
+    atomic_init(&s->idle, 0);
+    atomic_init(&s->full, 0);
+    return s;
+}
+
+void sched_delete(sched_t **s) {
+    if (s != NULL && *s != NULL) {
+        for (int i = 0; i < (*s)->workers; i++) {
+            pthread_mutex_destroy(&(*s)->deques[i].mutex);
+            free((*s)->deques[i].elem);
+        }
+        free((*s)->deques);
+        pthread_mutex_destroy(&(*s)->mutex);
+        pthread_cond_destroy(&(*s)->cv_work);
+        pthread_cond_destroy(&(*s)->cv_space);
+        free(*s);
+        *s = NULL;
+    }
+}
+
+// Wake one thread waiting on cv if count says there is one.  Sleepers
+// bump count (under s->mutex) before their final check, so either we
+// see them here or their check sees our push/pop.
+static void wake(sched_t *s, _Atomic int *count, pthread_cond_t *cv) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(count) > 0) {
+        pthread_mutex_lock(&s->mutex);
+        pthread_cond_signal(cv);
+        pthread_mutex_unlock(&s->mutex);
+    }
+}
+
+static bool try_push(sched_t *s, void *elem) {
+    unsigned int start = atomic_fetch_add_explicit(&s->next, 1, memory_order_relaxed);
+    for (int i = 0; i < s->workers; i++) {
+        if (push_back(&s->deques[(start + i) % s->workers], s->capacity, elem)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool try_pop(sched_t *s, int worker, void **elem) {
+    if (pop_front(&s->deques[worker], s->capacity, elem)) {
+        return true;
+    }
+    for (int i = 1; i < s->workers; i++) {
+        if (pop_back(&s->deques[(worker + i) % s->workers], s->capacity, elem)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool sched_push(sched_t *s, void *elem) {
+    if (s == NULL || elem == NULL) {
+        return false;
+    }
+    if (!try_push(s, elem)) {
+        // every deque is full
+        pthread_mutex_lock(&s->mutex);
+        atomic_fetch_add(&s->full, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!try_push(s, elem)) {
+            pthread_cond_wait(&s->cv_space, &s->mutex);
+        }
+        atomic_fetch_sub(&s->full, 1);
+        pthread_mutex_unlock(&s->mutex);
+    }
+    wake(s, &s->idle, &s->cv_work);
+    return true;
+}
+
+bool sched_try_push(sched_t *s, void *elem) {
+    if (s == NULL || elem == NULL || !try_push(s, elem)) {
+        return false;
+    }
+    wake(s, &s->idle, &s->cv_work);
+    return true;
+}
+
+bool sched_pop(sched_t *s, int worker, void **elem) {
+    if (s == NULL || elem == NULL) {
+        return false;
+    }
+    if (!try_pop(s, worker, elem)) {
+        // nothing to run or steal
+        pthread_mutex_lock(&s->mutex);
+        atomic_fetch_add(&s->idle, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!try_pop(s, worker, elem)) {
+            pthread_cond_wait(&s->cv_work, &s->mutex);
+        }
+        atomic_fetch_sub(&s->idle, 1);
+        pthread_mutex_unlock(&s->mutex);
+    }
+    wake(s, &s->full, &s->cv_space);
+    return true;
+}
+
+int sched_length(sched_t *s) {
+    if (s == NULL) {
+        return 0;
+    }
+    int length = 0;
+    for (int i = 0; i < s->workers; i++) {
+        pthread_mutex_lock(&s->deques[i].mutex);
+        length += s->deques[i].length;
+        pthread_mutex_unlock(&s->deques[i].mutex);
+    }
+    return length;
+}
@@ -0,0 +1,83 @@
+/**
+ * @File sched.h
+ *
+ * A work-stealing scheduler for the worker pool.  Every worker owns a
+ * bounded deque; the dispatcher hands out elements round-robin across
+ * the deques, and a worker whose own deque is empty steals from the
+ * back of its peers' deques before going to sleep.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/** @struct sched_t
+ *
+ *  @brief This typedef renames the struct sched.
+ */
+typedef struct sched sched_t;
+
+/** @brief Dynamically allocates and initializes a new scheduler.
+ *
+ *  @param workers the number of workers (and deques).
+ *
+ *  @param capacity the maximum number of elements in each deque.
+ *
+ *  @return a pointer to a new sched_t
+ */
+sched_t *sched_new(int workers, int capacity);
+
+/** @brief Delete a scheduler and free all of its memory.
+ *
+ *  @param s the scheduler to be deleted.  *s is set to NULL.
+ */
+void sched_delete(sched_t **s);
+
+/** @brief Hand an element to the next worker in round-robin order,
+ *         skipping workers whose deques are full.  Blocks if every
+ *         deque is full.
+ *
+ *  @param s the scheduler.
+ *
+ *  @param elem the element to push.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless s or elem is NULL.
+ */
+bool sched_push(sched_t *s, void *elem);
+
+/** @brief Hand an element to the next worker in round-robin order,
+ *         like sched_push, unless every deque is full.
+ *
+ *  @param s the scheduler.
+ *
+ *  @param elem the element to push.
+ *
+ *  @return true if elem was pushed, false if every deque is full (or s
+ *          or elem is NULL).
+ */
+bool sched_try_push(sched_t *s, void *elem);
+
+/** @brief Take the next element for a worker: the front of its own
+ *         deque, or else the back of a peer's deque.  Blocks if every
+ *         deque is empty.
+ *
+ *  @param s the scheduler.
+ *
+ *  @param worker the index of the calling worker, in [0, workers).
+ *
+ *  @param elem a place to assign the popped element.
+ *
+ *  @return A bool indicating success or failure.  Note, the function
+ *          should succeed unless s or elem is NULL.
+ */
+bool sched_pop(sched_t *s, int worker, void **elem);
+
+/** @brief The number of elements in all of the deques, for monitoring.
+ *         It may be out of date as soon as it is returned.
+ *
+ *  @param s the scheduler.
+ *
+ *  @return the number of elements, or 0 if s is NULL.
+ */
+int sched_length(sched_t *s);
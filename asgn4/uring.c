@@ -0,0 +1,291 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+// the longest chain that an operation submits
+#define MAX_CHAIN 2
+
+typedef struct uring {
+    int fd;
+
+    // submission queue (we are its only producer)
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // completion queue (we are its only consumer)
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring; // == sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_len;
+    size_t sqes_len;
+
+    char *buf; // returned by uring_buffer
+    size_t buf_len;
+
+    // requests of a failed submit() whose completions are still owed
+    unsigned stale;
+} uring;
+
+uring_t *uring_new(unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    uring_t *ring = malloc(sizeof(uring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+    ring->fd = fd;
+    ring->buf = NULL;
+    ring->buf_len = 0;
+    ring->stale = 0;
+    ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring->cq_ring_len > ring->sq_ring_len) {
+        ring->sq_ring_len = ring->cq_ring_len;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = single ? ring->sq_ring
+                           : mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        if (ring->sq_ring != MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_len);
+        }
+        if (!single && ring->cq_ring != MAP_FAILED) {
+            munmap(ring->cq_ring, ring->cq_ring_len);
+        }
+        if (ring->sqes != MAP_FAILED) {
+            munmap(ring->sqes, ring->sqes_len);
+        }
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    char *sq = ring->sq_ring;
+    ring->sq_head = (_Atomic unsigned *) (sq + p.sq_off.head);
+    ring->sq_tail = (_Atomic unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+
+    char *cq = ring->cq_ring;
+    ring->cq_head = (_Atomic unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (_Atomic unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return ring;
+}
+
+void uring_delete(uring_t **ring) {
+    if (ring != NULL && *ring != NULL) {
+        munmap((*ring)->sqes, (*ring)->sqes_len);
+        if ((*ring)->cq_ring != (*ring)->sq_ring) {
+            munmap((*ring)->cq_ring, (*ring)->cq_ring_len);
+        }
+        munmap((*ring)->sq_ring, (*ring)->sq_ring_len);
+        close((*ring)->fd);
+        free((*ring)->buf);
+        free(*ring);
+        *ring = NULL;
+    }
+}
+
+// Return the i-th entry of the next submission, cleared.  The chain's
+// entries are not visible to the kernel until submit().
+static struct io_uring_sqe *next_sqe(uring_t *ring, unsigned i) {
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed) + i;
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    sqe->user_data = i;
+    return sqe;
+}
+
+// Wait for (and drop) the completions that a failed submit() still
+// owes, so they are never taken for a later call's. Returns -1 with
+// errno set if the kernel won't wait for them.
+static int reap_stale(uring_t *ring) {
+    while (ring->stale > 0) {
+        int rc = syscall(
+            __NR_io_uring_enter, ring->fd, 0, ring->stale, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR) {
+            return -1;
+        }
+        unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        while (ring->stale > 0 && head != atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+            head++;
+            ring->stale--;
+        }
+        atomic_store_explicit(ring->cq_head, head, memory_order_release);
+    }
+    return 0;
+}
+
+// Submit the n entries from next_sqe() and wait for all of their
+// completions.  res[i] is the result of the i-th entry.
+static int submit(uring_t *ring, unsigned n, int *res) {
+    if (reap_stale(ring) < 0) {
+        return -1;
+    }
+    unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    atomic_store_explicit(ring->sq_tail, tail + n, memory_order_release);
+
+    unsigned submitted = 0, done = 0;
+    while (done < n) {
+        int rc = syscall(__NR_io_uring_enter, ring->fd, n - submitted, n - done,
+            IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR) {
+            // an error means that this call took nothing: take back the
+            // requests that the kernel never saw, and wait out those it
+            // did (now, or before the next submit if that fails too)
+            int err = errno;
+            atomic_store_explicit(ring->sq_tail, tail + submitted, memory_order_release);
+            ring->stale = submitted - done;
+            reap_stale(ring);
+            errno = err;
+            return -1;
+        } else if (rc > 0) {
+            submitted += rc;
+        }
+
+        unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+        while (head != atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+            if (cqe->user_data < n) {
+                res[cqe->user_data] = cqe->res;
+                done++;
+            }
+            head++;
+        }
+        atomic_store_explicit(ring->cq_head, head, memory_order_release);
+    }
+    return 0;
+}
+
+char *uring_buffer(uring_t *ring, size_t size) {
+    if (size > ring->buf_len) {
+        char *buf = realloc(ring->buf, size);
+        if (buf == NULL) {
+            return NULL;
+        }
+        ring->buf = buf;
+        ring->buf_len = size;
+    }
+    return ring->buf;
+}
+
+int uring_open_stat(uring_t *ring, const char *path, struct stat *st) {
+    struct statx stx;
+    int res[2];
+
+    struct io_uring_sqe *sqe = next_sqe(ring, 0);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = next_sqe(ring, 1);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->len = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_INO | STATX_MTIME;
+    sqe->off = (uintptr_t) &stx;
+
+    if (submit(ring, 2, res) < 0) {
+        return -1;
+    }
+    if (res[0] < 0) {
+        errno = -res[0];
+        return -1;
+    } else if (res[1] < 0) {
+        close(res[0]);
+        errno = -res[1];
+        return -1;
+    }
+    st->st_size = stx.stx_size;
+    st->st_mode = stx.stx_mode;
+    st->st_ino = stx.stx_ino;
+    st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    return res[0];
+}
+
+int uring_send_file(uring_t *ring, int sock, char *buf, size_t head, int fd, size_t size) {
+    int res[2];
+
+    struct io_uring_sqe *sqe = next_sqe(ring, 0);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) (buf + head);
+    sqe->len = size;
+    sqe->off = 0; // never the file offset, which fd may share
+    sqe->flags = IOSQE_IO_LINK; // a short read cancels the send
+
+    sqe = next_sqe(ring, 1);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = head + size;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+    if (submit(ring, 2, res) < 0) {
+        return -1;
+    }
+
+    if (res[0] >= 0 && (size_t) res[0] != size) {
+        errno = EIO; // the file is shorter than its size
+        return -1;
+    } else if (res[0] < 0 || res[1] < 0) {
+        errno = res[0] < 0 ? -res[0] : -res[1];
+        return -1;
+    }
+
+    // a stream socket may still take less than everything
+    size_t sent = res[1];
+    while (sent < head + size) {
+        ssize_t n = send(sock, buf + sent, head + size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return -1;
+        }
+        sent += n;
+    }
+    return 0;
+}
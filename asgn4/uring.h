@@ -0,0 +1,85 @@
+/**
+ * @File uring.h
+ *
+ * A minimal io_uring engine, on the raw system calls (no liburing).
+ * Each ring belongs to one thread.  The operations below submit a short
+ * chain of linked requests with a single io_uring_enter() and wait for
+ * all of them, so one system call does the work of several.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/** @struct uring_t
+ *
+ *  @brief This typedef renames the struct uring.
+ */
+typedef struct uring uring_t;
+
+/** @brief Dynamically allocates and initializes a new ring.
+ *
+ *  @param entries the number of submission queue entries.
+ *
+ *  @return a pointer to a new uring_t, or NULL if the kernel does not
+ *          support io_uring (or it is disabled).
+ */
+uring_t *uring_new(unsigned entries);
+
+/** @brief Delete a ring.
+ *
+ *  @param ring the ring to be deleted.  *ring is set to NULL.
+ */
+void uring_delete(uring_t **ring);
+
+/** @brief Open path for reading and get its metadata: an openat linked
+ *         to a statx, in one submission.
+ *
+ *  @param ring the calling thread's ring.
+ *
+ *  @param path the file to open, relative to the working directory.
+ *
+ *  @param st set to the file's type and permissions, size, inode and
+ *         modification time (its other fields are left alone).
+ *
+ *  @return the new file descriptor, or -1 with errno set.
+ */
+int uring_open_stat(uring_t *ring, const char *path, struct stat *st);
+
+/** @brief A buffer that belongs to the ring (and so to its thread),
+ *         for the header and file of uring_send_file.  It grows as
+ *         needed and is reused, so sends allocate nothing once it is
+ *         large enough.
+ *
+ *  @param ring the calling thread's ring.
+ *
+ *  @param size the number of bytes needed.
+ *
+ *  @return the buffer, valid until the next call or uring_delete, or
+ *          NULL if it can't grow.
+ */
+char *uring_buffer(uring_t *ring, size_t size);
+
+/** @brief Send a header and a whole file to a socket: a read of the
+ *         file into buf (right after the header) linked to a send of
+ *         both, in one submission.
+ *
+ *  @param ring the calling thread's ring.
+ *
+ *  @param sock the socket.
+ *
+ *  @param buf the header, followed by room for size bytes.
+ *
+ *  @param head the length of the header.
+ *
+ *  @param fd the file.  It is read from offset 0 (its file offset is
+ *         neither used nor moved), and left open.
+ *
+ *  @param size the size of the file.
+ *
+ *  @return 0 if everything was sent, or -1 with errno set.
+ */
+int uring_send_file(uring_t *ring, int sock, char *buf, size_t head, int fd, size_t size);
@@ -0,0 +1,314 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+#define INITIAL_BUCKETS 64
+
+typedef struct cache_entry {
+    char *key;
+    void *data;
+    size_t size;
+    struct stat st;
+    _Atomic int refs; // one for the cache, plus one per cache_get
+    bool referenced; // CLOCK: used since the hand last passed
+    struct cache_entry *hnext; // next in the hash bucket
+    struct cache_entry *prev; // eviction order (oldest first)
+    struct cache_entry *next;
+} cache_entry;
+
+typedef struct cache {
+    size_t capacity; // maximum bytes
+    size_t used; // bytes currently cached
+    cache_policy_t policy;
+
+    cache_entry **buckets;
+    size_t nbuckets; // always a power of two
+    size_t count; // number of entries
+
+    // eviction order: FIFO = insertion order, LRU = recency order.
+    // CLOCK uses the list as a ring, starting from hand.
+    cache_entry *head;
+    cache_entry *tail;
+    cache_entry *hand;
+
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t mutex;
+} cache;
+
+// FNV-1a
+static size_t hash(const char *key) {
+    uint64_t h = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *) key; *c; c++) {
+        h ^= *c;
+        h *= 1099511628211ULL;
+    }
+    return (size_t) h;
+}
+
+cache_t *cache_new(size_t capacity, cache_policy_t policy) {
+    cache_t *c = malloc(sizeof(cache));
+    if (c == NULL) {
+        fprintf(stderr, "failed to create new cache in cache_new()\n");
+        exit(1);
+    }
+    c->buckets = calloc(INITIAL_BUCKETS, sizeof(cache_entry *));
+    if (c->buckets == NULL) {
+        fprintf(stderr, "failed to allocate buckets in cache_new()\n");
+        exit(1);
+    }
+    int rc = pthread_mutex_init(&c->mutex, NULL);
+    assert(!rc);
+    (void) rc;
+
+    c->capacity = capacity;
+    c->used = 0;
+    c->policy = policy;
+    c->nbuckets = INITIAL_BUCKETS;
+    c->count = 0;
+    c->head = NULL;
+    c->tail = NULL;
+    c->hand = NULL;
+    c->hits = 0;
+    c->misses = 0;
+    return c;
+}
+
+static void entry_unref(cache_entry *e) {
+    if (atomic_fetch_sub(&e->refs, 1) == 1) {
+        free(e->key);
+        free(e->data);
+        free(e);
+    }
+}
+
+void cache_delete(cache_t **c) {
+    if (c != NULL && *c != NULL) {
+        cache_entry *e = (*c)->head;
+        while (e != NULL) {
+            cache_entry *next = e->next;
+            entry_unref(e);
+            e = next;
+        }
+        pthread_mutex_destroy(&(*c)->mutex);
+        free((*c)->buckets);
+        free(*c);
+        *c = NULL;
+    }
+}
+
+// All of the helpers below are called with c->mutex held.
+
+static cache_entry **find(cache_t *c, const char *key) {
+    cache_entry **pe = &c->buckets[hash(key) & (c->nbuckets - 1)];
+    while (*pe != NULL && strcmp((*pe)->key, key) != 0) {
+        pe = &(*pe)->hnext;
+    }
+    return pe;
+}
+
+static void grow(cache_t *c) {
+    size_t n = c->nbuckets * 2;
+    cache_entry **buckets = calloc(n, sizeof(cache_entry *));
+    if (buckets == NULL) {
+        return; // keep the longer chains
+    }
+    for (size_t i = 0; i < c->nbuckets; i++) {
+        cache_entry *e = c->buckets[i];
+        while (e != NULL) {
+            cache_entry *hnext = e->hnext;
+            size_t b = hash(e->key) & (n - 1);
+            e->hnext = buckets[b];
+            buckets[b] = e;
+            e = hnext;
+        }
+    }
+    free(c->buckets);
+    c->buckets = buckets;
+    c->nbuckets = n;
+}
+
+static void list_unlink(cache_t *c, cache_entry *e) {
+    if (c->hand == e) {
+        c->hand = e->next != NULL ? e->next : c->head;
+        if (c->hand == e) {
+            c->hand = NULL;
+        }
+    }
+    if (e->prev) {
+        e->prev->next = e->next;
+    } else {
+        c->head = e->next;
+    }
+    if (e->next) {
+        e->next->prev = e->prev;
+    } else {
+        c->tail = e->prev;
+    }
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void list_append(cache_t *c, cache_entry *e) {
+    e->next = NULL;
+    e->prev = c->tail;
+    if (c->tail) {
+        c->tail->next = e;
+    } else {
+        c->head = e;
+    }
+    c->tail = e;
+}
+
+// Insert e so that it is the last entry the CLOCK hand reaches.
+static void list_insert_behind_hand(cache_t *c, cache_entry *e) {
+    if (c->hand == NULL || c->hand == c->head) {
+        list_append(c, e);
+    } else {
+        e->next = c->hand;
+        e->prev = c->hand->prev;
+        c->hand->prev->next = e;
+        c->hand->prev = e;
+    }
+    if (c->hand == NULL) {
+        c->hand = e;
+    }
+}
+
+// Remove the entry at *pe from the cache and drop the cache's reference.
+static void remove_entry(cache_t *c, cache_entry **pe) {
+    cache_entry *e = *pe;
+    *pe = e->hnext;
+    list_unlink(c, e);
+    c->used -= e->size;
+    c->count--;
+    entry_unref(e);
+}
+
+static cache_entry *victim(cache_t *c) {
+    if (c->policy != CACHE_CLOCK) {
+        return c->head;
+    }
+    // give each referenced entry a second chance
+    while (c->hand->referenced) {
+        c->hand->referenced = false;
+        c->hand = c->hand->next != NULL ? c->hand->next : c->head;
+    }
+    return c->hand;
+}
+
+cache_entry_t *cache_get(cache_t *c, const char *key) {
+    pthread_mutex_lock(&c->mutex);
+    cache_entry *e = *find(c, key);
+    if (e != NULL) {
+        c->hits++;
+        if (c->policy == CACHE_LRU) {
+            list_unlink(c, e);
+            list_append(c, e);
+        } else if (c->policy == CACHE_CLOCK) {
+            e->referenced = true;
+        }
+        atomic_fetch_add(&e->refs, 1);
+    } else {
+        c->misses++;
+    }
+    pthread_mutex_unlock(&c->mutex);
+    return e;
+}
+
+bool cache_put(cache_t *c, const char *key, const void *data, size_t size, const struct stat *st) {
+    if (size > c->capacity) {
+        return false;
+    }
+
+    // copy outside of the lock
+    cache_entry *e = malloc(sizeof(cache_entry));
+    if (e == NULL) {
+        return false;
+    }
+    e->key = strdup(key);
+    e->data = malloc(size > 0 ? size : 1);
+    if (e->key == NULL || e->data == NULL) {
+        free(e->key);
+        free(e->data);
+        free(e);
+        return false;
+    }
+    memcpy(e->data, data, size);
+    e->size = size;
+    if (st != NULL) {
+        e->st = *st;
+    } else {
+        memset(&e->st, 0, sizeof(e->st));
+    }
+    atomic_init(&e->refs, 1);
+    e->referenced = false;
+
+    pthread_mutex_lock(&c->mutex);
+    cache_entry **pe = find(c, key);
+    if (*pe != NULL) {
+        remove_entry(c, pe);
+    }
+    while (c->used + size > c->capacity) {
+        cache_entry *v = victim(c);
+        remove_entry(c, find(c, v->key));
+    }
+
+    if (c->count >= c->nbuckets) {
+        grow(c);
+    }
+    pe = &c->buckets[hash(key) & (c->nbuckets - 1)];
+    e->hnext = *pe;
+    *pe = e;
+    if (c->policy == CACHE_CLOCK) {
+        list_insert_behind_hand(c, e);
+    } else {
+        list_append(c, e);
+    }
+    c->used += size;
+    c->count++;
+    pthread_mutex_unlock(&c->mutex);
+    return true;
+}
+
+void cache_invalidate(cache_t *c, const char *key) {
+    pthread_mutex_lock(&c->mutex);
+    cache_entry **pe = find(c, key);
+    if (*pe != NULL) {
+        remove_entry(c, pe);
+    }
+    pthread_mutex_unlock(&c->mutex);
+}
+
+void cache_stats(cache_t *c, uint64_t *hits, uint64_t *misses) {
+    pthread_mutex_lock(&c->mutex);
+    *hits = c->hits;
+    *misses = c->misses;
+    pthread_mutex_unlock(&c->mutex);
+}
+
+const void *cache_entry_data(const cache_entry_t *e) {
+    return e->data;
+}
+
+size_t cache_entry_size(const cache_entry_t *e) {
+    return e->size;
+}
+
+const struct stat *cache_entry_stat(const cache_entry_t *e) {
+    return &e->st;
+}
+
+void cache_entry_release(cache_entry_t **e) {
+    if (e != NULL && *e != NULL) {
+        entry_unref(*e);
+        *e = NULL;
+    }
+}
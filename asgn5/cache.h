@@ -0,0 +1,119 @@
+/**
+ * @File cache.h
+ *
+ * A bounded, thread-safe object cache.  Objects are byte strings keyed
+ * by name; the cache holds at most a fixed number of bytes and evicts
+ * objects in FIFO, LRU or CLOCK order.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/** @brief The eviction policies.
+ */
+typedef enum {
+    CACHE_FIFO, // evict the object that was inserted first
+    CACHE_LRU, // evict the object that was used least recently
+    CACHE_CLOCK, // second chance: skip (once) objects used since the hand passed
+} cache_policy_t;
+
+/** @struct cache_t
+ *
+ *  @brief This typedef renames the struct cache.
+ */
+typedef struct cache cache_t;
+
+/** @struct cache_entry_t
+ *
+ *  @brief A reference to a cached object.  The object stays valid
+ *         until the reference is released, even if it is evicted or
+ *         invalidated in the meantime.
+ */
+typedef struct cache_entry cache_entry_t;
+
+/** @brief Dynamically allocates and initializes a new cache.
+ *
+ *  @param capacity the maximum number of bytes of objects to hold.
+ *
+ *  @param policy the eviction policy.
+ *
+ *  @return a pointer to a new cache_t
+ */
+cache_t *cache_new(size_t capacity, cache_policy_t policy);
+
+/** @brief Delete a cache and free all of its memory.  Entries that
+ *         are still referenced are freed when they are released.
+ *
+ *  @param c the cache to be deleted.  *c is set to NULL.
+ */
+void cache_delete(cache_t **c);
+
+/** @brief Look up an object, counting a hit or a miss.
+ *
+ *  @param c the cache.
+ *
+ *  @param key the name of the object.
+ *
+ *  @return a reference to the object, which the caller must release
+ *          with cache_entry_release, or NULL on a miss.
+ */
+cache_entry_t *cache_get(cache_t *c, const char *key);
+
+/** @brief Insert (or replace) an object, evicting others to make room.
+ *
+ *  @param c the cache.
+ *
+ *  @param key the name of the object.
+ *
+ *  @param data the bytes of the object; they are copied.
+ *
+ *  @param size the number of bytes in data.
+ *
+ *  @param st the metadata of the file that data was read from; it is
+ *         copied. NULL if there is none (it reads as all zeroes).
+ *
+ *  @return true if the object was inserted, false if it is larger than
+ *          the whole cache.
+ */
+bool cache_put(cache_t *c, const char *key, const void *data, size_t size, const struct stat *st);
+
+/** @brief Remove an object (if it is cached).
+ *
+ *  @param c the cache.
+ *
+ *  @param key the name of the object.
+ */
+void cache_invalidate(cache_t *c, const char *key);
+
+/** @brief Return the number of hits and misses so far.
+ *
+ *  @param c the cache.
+ *
+ *  @param hits a place to assign the number of hits.
+ *
+ *  @param misses a place to assign the number of misses.
+ */
+void cache_stats(cache_t *c, uint64_t *hits, uint64_t *misses);
+
+/** @brief Return the bytes of a cached object.
+ */
+const void *cache_entry_data(const cache_entry_t *e);
+
+/** @brief Return the number of bytes in a cached object.
+ */
+size_t cache_entry_size(const cache_entry_t *e);
+
+/** @brief Return the metadata of the file that a cached object was read
+ *         from, as of when it was read.
+ */
+const struct stat *cache_entry_stat(const cache_entry_t *e);
+
+/** @brief Release a reference returned by cache_get.
+ *
+ *  @param e the reference to release.  *e is set to NULL.
+ */
+void cache_entry_release(cache_entry_t **e);
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+#define OPTIONS "N:FLC"
+#define MAX_KEY 4096
+
+// Replays a trace of keys (one per line on stdin) through the cache,
+// treating every object as one byte, so the cache holds N objects.
+// Prints HIT or MISS for each access and the totals at the end.
+int main(int argc, char **argv) {
+    size_t size = 0;
+    cache_policy_t policy = CACHE_FIFO;
+    int opt;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'N': size = strtoul(optarg, NULL, 10); break;
+        case 'F': policy = CACHE_FIFO; break;
+        case 'L': policy = CACHE_LRU; break;
+        case 'C': policy = CACHE_CLOCK; break;
+        default: fprintf(stderr, "usage: %s -N size [-F | -L | -C]\n", argv[0]); return 1;
+        }
+    }
+    if (size == 0) {
+        fprintf(stderr, "usage: %s -N size [-F | -L | -C]\n", argv[0]);
+        return 1;
+    }
+
+    cache_t *c = cache_new(size, policy);
+    char key[MAX_KEY];
+    while (fgets(key, MAX_KEY, stdin) != NULL) {
+        key[strcspn(key, "\n")] = 0;
+        cache_entry_t *e = cache_get(c, key);
+        if (e != NULL) {
+            printf("HIT\n");
+            cache_entry_release(&e);
+        } else {
+            printf("MISS\n");
+            cache_put(c, key, "", 1, NULL);
+        }
+    }
+
+    uint64_t hits, misses;
+    cache_stats(c, &hits, &misses);
+    printf("%lu %lu\n", hits, misses);
+    cache_delete(&c);
+    return 0;
+}
@@ -0,0 +1,350 @@
+// loadgen: a closed-loop HTTP load generator for the httpservers.
+//
+// Each of the -c client threads sends requests back to back (a mix of
+// GETs and PUTs over a set of files of the given sizes), reusing each
+// connection for up to -r requests, and records the latency of every
+// request. When -n requests have completed (or -d seconds have passed)
+// it prints one JSON object with the throughput and the latency
+// percentiles.
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OPTIONS "p:c:n:d:r:m:s:f:"
+
+#define MAX_SIZES  16
+#define MAX_HEADER 2048
+
+// the benchmark's configuration
+static int port = 0;
+static int clients = 4;
+static long total = 10000; // requests, unless duration is set
+static double duration = 0; // seconds
+static int reuse = 1; // requests per connection
+static int put_percent = 0;
+static size_t sizes[MAX_SIZES] = { 4096 };
+static int nsizes = 1;
+static int files = 4; // files of each size
+
+static char *body; // the bytes every PUT sends (as long as the largest size)
+static _Atomic long issued = 0; // requests claimed by the clients
+static _Atomic bool stop = false;
+
+// what one client thread measured
+typedef struct client {
+    pthread_t thread;
+    unsigned int seed;
+    uint32_t *lat; // microseconds per request
+    size_t nlat;
+    size_t cap;
+    long errors;
+    long connects;
+    uint64_t bytes; // body bytes sent and received
+} client;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char *prog) {
+    fprintf(stderr,
+        "usage: %s -p port [-c clients] [-n requests | -d seconds] [-r requests_per_conn]\n"
+        "          [-m put_percent] [-s size[,size...]] [-f files_per_size]\n",
+        prog);
+    exit(1);
+}
+
+static int connect_server(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Read one response from fd. Returns its status code (or -1 if the
+// connection failed), and sets *keep to whether fd can be reused.
+static int read_response(int fd, client *c, bool *keep) {
+    char head[MAX_HEADER + 1];
+    size_t have = 0;
+    char *end = NULL;
+    while (end == NULL) {
+        if (have == MAX_HEADER) {
+            return -1;
+        }
+        ssize_t n = read(fd, head + have, MAX_HEADER - have);
+        if (n <= 0) {
+            return -1;
+        }
+        have += n;
+        head[have] = 0;
+        end = strstr(head, "\r\n\r\n");
+    }
+
+    int code = 0;
+    if (sscanf(head, "HTTP/%*d.%*d %d", &code) != 1) {
+        return -1;
+    }
+    char *cl = strcasestr(head, "\r\nContent-Length:");
+    if (cl == NULL || cl > end) {
+        return -1;
+    }
+    uint64_t length = strtoull(cl + strlen("\r\nContent-Length:"), NULL, 10);
+    char *conn = strcasestr(head, "\r\nConnection: close");
+    *keep = conn == NULL || conn > end;
+
+    // discard the body
+    uint64_t got = have - (end + 4 - head);
+    char sink[65536];
+    while (got < length) {
+        size_t want = length - got < sizeof(sink) ? length - got : sizeof(sink);
+        ssize_t n = read(fd, sink, want);
+        if (n <= 0) {
+            return -1;
+        }
+        got += n;
+    }
+    c->bytes += length;
+    return code;
+}
+
+// Send one request on *fd (connecting first if *fd < 0). Returns
+// whether the response had the expected status.
+static bool request(int *fd, bool put, const char *name, size_t size, bool last, client *c) {
+    if (*fd < 0) {
+        *fd = connect_server();
+        c->connects++;
+        if (*fd < 0) {
+            return false;
+        }
+    }
+
+    char head[512];
+    int n;
+    if (put) {
+        n = snprintf(head, sizeof(head),
+            "PUT /%s HTTP/1.1\r\nContent-Length: %zu\r\nRequest-Id: %ld\r\n%s\r\n", name, size,
+            (long) c->nlat, last ? "Connection: close\r\n" : "");
+    } else {
+        n = snprintf(head, sizeof(head), "GET /%s HTTP/1.1\r\nRequest-Id: %ld\r\n%s\r\n", name,
+            (long) c->nlat, last ? "Connection: close\r\n" : "");
+    }
+
+    bool keep = false;
+    int code = -1;
+    if (write_all(*fd, head, n) && (!put || write_all(*fd, body, size))) {
+        if (put) {
+            c->bytes += size;
+        }
+        code = read_response(*fd, c, &keep);
+    }
+    if (last || !keep || code < 0) {
+        close(*fd);
+        *fd = -1;
+    }
+    return put ? code == 200 || code == 201 : code == 200;
+}
+
+static void record(client *c, double seconds) {
+    if (c->nlat == c->cap) {
+        c->cap = c->cap ? 2 * c->cap : 4096;
+        c->lat = realloc(c->lat, c->cap * sizeof(uint32_t));
+        if (c->lat == NULL) {
+            fprintf(stderr, "failed to allocate latencies in record()\n");
+            exit(1);
+        }
+    }
+    double us = seconds * 1e6;
+    c->lat[c->nlat++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t) us;
+}
+
+static void *run_client(void *arg) {
+    client *c = arg;
+    int fd = -1;
+    int on_conn = 0; // requests sent on fd so far
+
+    while (!atomic_load(&stop)) {
+        if (duration == 0 && atomic_fetch_add(&issued, 1) >= total) {
+            break;
+        }
+        int s = rand_r(&c->seed) % nsizes;
+        int f = rand_r(&c->seed) % files;
+        bool put = (int) (rand_r(&c->seed) % 100) < put_percent;
+        char name[64];
+        snprintf(name, sizeof(name), "bench-%zu-%d", sizes[s], f);
+
+        if (fd < 0) {
+            on_conn = 0;
+        }
+        on_conn++;
+        double start = now();
+        bool ok = request(&fd, put, name, sizes[s], on_conn == reuse, c);
+        record(c, now() - start);
+        if (!ok) {
+            c->errors++;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+// the p-th percentile (nearest rank) of n sorted values
+static uint32_t percentile(uint32_t *v, size_t n, double p) {
+    if (n == 0) {
+        return 0;
+    }
+    size_t rank = (size_t) (p / 100 * n + 0.999999);
+    return v[rank == 0 ? 0 : rank - 1];
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'c': clients = atoi(optarg); break;
+        case 'n': total = atol(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'r': reuse = atoi(optarg); break;
+        case 'm': put_percent = atoi(optarg); break;
+        case 'f': files = atoi(optarg); break;
+        case 's':
+            nsizes = 0;
+            for (char *tok = strtok(optarg, ","); tok != NULL && nsizes < MAX_SIZES;
+                 tok = strtok(NULL, ",")) {
+                sizes[nsizes++] = strtoull(tok, NULL, 10);
+            }
+            break;
+        default: usage(argv[0]);
+        }
+    }
+    if (port <= 0 || clients <= 0 || reuse <= 0 || files <= 0 || nsizes == 0) {
+        usage(argv[0]);
+    }
+
+    size_t largest = 0;
+    for (int i = 0; i < nsizes; i++) {
+        largest = sizes[i] > largest ? sizes[i] : largest;
+    }
+    body = malloc(largest + 1);
+    if (body == NULL) {
+        fprintf(stderr, "failed to allocate body in main()\n");
+        return 1;
+    }
+    for (size_t i = 0; i < largest; i++) {
+        body[i] = 'a' + i % 26;
+    }
+
+    // create every file, so that GETs find them
+    client setup = { 0 };
+    for (int s = 0; s < nsizes; s++) {
+        for (int f = 0; f < files; f++) {
+            char name[64];
+            snprintf(name, sizeof(name), "bench-%zu-%d", sizes[s], f);
+            int fd = -1;
+            if (!request(&fd, true, name, sizes[s], true, &setup)) {
+                fprintf(stderr, "failed to create %s on port %d\n", name, port);
+                return 1;
+            }
+        }
+    }
+
+    client *cs = calloc(clients, sizeof(client));
+    double start = now();
+    for (int i = 0; i < clients; i++) {
+        cs[i].seed = i + 1;
+        pthread_create(&cs[i].thread, NULL, run_client, &cs[i]);
+    }
+    if (duration > 0) {
+        struct timespec ts = { (time_t) duration, (long) ((duration - (time_t) duration) * 1e9) };
+        nanosleep(&ts, NULL);
+        atomic_store(&stop, true);
+    }
+
+    size_t n = 0;
+    long errors = 0, connects = 0;
+    uint64_t bytes = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(cs[i].thread, NULL);
+        n += cs[i].nlat;
+        errors += cs[i].errors;
+        connects += cs[i].connects;
+        bytes += cs[i].bytes;
+    }
+    double elapsed = now() - start;
+
+    uint32_t *lat = malloc((n ? n : 1) * sizeof(uint32_t));
+    size_t k = 0;
+    double sum = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(lat + k, cs[i].lat, cs[i].nlat * sizeof(uint32_t));
+        k += cs[i].nlat;
+        free(cs[i].lat);
+    }
+    qsort(lat, n, sizeof(uint32_t), cmp_u32);
+    for (size_t i = 0; i < n; i++) {
+        sum += lat[i];
+    }
+
+    printf("{\"clients\": %d, \"reuse\": %d, \"put_percent\": %d, \"sizes\": [", clients, reuse,
+        put_percent);
+    for (int i = 0; i < nsizes; i++) {
+        printf("%s%zu", i ? ", " : "", sizes[i]);
+    }
+    printf("], \"requests\": %zu, \"errors\": %ld, \"connections\": %ld, \"seconds\": %.3f, "
+           "\"throughput\": %.1f, \"mbytes_per_sec\": %.2f, \"mean_us\": %.1f, \"p50_us\": %u, "
+           "\"p99_us\": %u, \"p999_us\": %u, \"max_us\": %u}\n",
+        n, errors, connects, elapsed, n / elapsed, bytes / elapsed / 1e6, n ? sum / n : 0.0,
+        percentile(lat, n, 50), percentile(lat, n, 99), percentile(lat, n, 99.9),
+        n ? lat[n - 1] : 0);
+
+    free(lat);
+    free(cs);
+    free(body);
+    return errors > 0;
+}
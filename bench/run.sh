@@ -0,0 +1,60 @@
+#!/bin/bash
+# Run the benchmark matrix against one server binary and print one JSON
+# object per scenario.
+#
+# usage: run.sh server [server args...]
+#
+# Environment: CLIENTS (concurrency levels), MIXES (PUT percentages),
+# SIZES (file size sets), REUSE (requests per connection; >1 needs a
+# server with keep-alive), REQUESTS (per scenario).
+
+set -u
+
+SERVER=$(realpath "$1")
+shift
+if [ ! -x "$SERVER" ]; then
+    echo "no server at $SERVER" >&2
+    exit 1
+fi
+LOADGEN=$(realpath "$(dirname "$0")/loadgen")
+
+CLIENTS=${CLIENTS:-"1 4 16 64"}
+MIXES=${MIXES:-"0 10 50"}
+SIZES=${SIZES:-"1024 65536 1024,65536,1048576"}
+REUSE=${REUSE:-1}
+REQUESTS=${REQUESTS:-5000}
+
+DIR=$(mktemp -d)
+trap 'kill $PID 2>/dev/null; wait $PID 2>/dev/null; rm -rf "$DIR"' EXIT
+
+# find a free port and start the server in a scratch directory. Ports
+# are picked below the ephemeral range, where the TIME_WAIT sockets of
+# earlier runs live
+PID=
+for try in 1 2 3 4 5; do
+    PORT=$((10000 + RANDOM % 20000))
+    (cd "$DIR" && exec "$SERVER" "$@" "$PORT" 2>/dev/null) &
+    PID=$!
+    sleep 0.3
+    if kill -0 $PID 2>/dev/null && (exec 3<>"/dev/tcp/127.0.0.1/$PORT") 2>/dev/null; then
+        break
+    fi
+    kill $PID 2>/dev/null
+    wait $PID 2>/dev/null
+    PID=
+done
+if [ -z "$PID" ]; then
+    echo "could not start $SERVER" >&2
+    exit 1
+fi
+
+status=0
+for sizes in $SIZES; do
+    for mix in $MIXES; do
+        for c in $CLIENTS; do
+            "$LOADGEN" -p "$PORT" -c "$c" -n "$REQUESTS" -r "$REUSE" -m "$mix" -s "$sizes" \
+                || status=1
+        done
+    done
+done
+exit $status